@@ -1,10 +1,31 @@
 #include <linux/spi/spi.h>
 #include <linux/interrupt.h>
 #include <linux/delay.h>
-#include <linux/workqueue.h>
 #include <linux/netdevice.h>
 #include <linux/phy.h>
 #include <linux/etherdevice.h>
+#include <linux/moduleparam.h>
+#include <linux/property.h>
+#include <linux/iopoll.h>
+#include <net/page_pool/helpers.h>
+#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ethtool.h>
+#include <linux/dim.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/static_key.h>
+#include <linux/crc-itu-t.h>
+#include <linux/cpumask.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_vlan.h>
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <net/xdp.h>
+
+#define CREATE_TRACE_POINTS
+#include "ssed_trace.h"
 
 #define SET_SMI_OP 0x1
 #define GET_SMI 0x2
@@ -13,345 +34,3280 @@
 #define SEND_FRAME 0x6
 #define RECV_FRAME 0x7
 #define GET_IRQ 0x8
+#define ECHO 0x9
+#define GET_FEATURES 0xa
+#define GET_SMI_STATUS 0xb
+#define GET_TX_FREE 0xc
+#define SEND_FRAMES 0xd
+#define RECV_FRAMES 0xe
+#define SET_COALESCE 0xf
+#define SET_CRC 0x10
+#define RETRANSMIT 0x11
+#define SEND_RECV_FRAME 0x12
+#define SET_STATUS 0x13
+#define SET_SMI_REGS 0x14
+#define GET_SMI_REGS 0x15
+
+/* Feature bits reported by GET_FEATURES, old firmware reports none */
+#define SSED_FEAT_SMI_STATUS BIT(0)
+#define SSED_FEAT_TX_FREE BIT(1)
+#define SSED_FEAT_TX_BATCH BIT(2)
+#define SSED_FEAT_RX_BATCH BIT(3)
+#define SSED_FEAT_COALESCE BIT(4)
+#define SSED_FEAT_CRC BIT(5)
+#define SSED_FEAT_DUPLEX BIT(6)
+#define SSED_FEAT_STATUS BIT(7)
+#define SSED_FEAT_LINK_IRQ BIT(8)
+#define SSED_FEAT_SMI_REGS BIT(9)
+
+/* Commands are counted by opcode, 0 stands for data following a command */
+#define SSED_NR_CMDS 32
+
+/*
+ * SET_COALESCE: the W7500 holds the frame received IRQ back, until rx-frames
+ * frames are waiting or rx-usecs passed since the first one, and raises the
+ * frame sent IRQ every tx-frames frames.
+ */
+#define SSED_COALESCE_LEN 5
+#define SSED_COALESCE_MAX_USECS 0xffff
+#define SSED_COALESCE_MAX_FRAMES 0xff
+
+/*
+ * With tx-frames > 1 the frame sent IRQ may never come, if the last frames
+ * don't fill the count. A blocked TX polls the W7500 for its space instead.
+ */
+#define SSED_TX_POLL_MS 1
+
+/*
+ * Without an IRQ line, GET_IRQ is polled. The interval starts at the minimum,
+ * while frames flow, and doubles up to the maximum, while the W7500 is idle.
+ */
+#define SSED_IRQ_POLL_MIN_US 100
+#define SSED_IRQ_POLL_MAX_US 10000
+#define SSED_IRQ_POLL_LIMIT_US 1000000
+
+/*
+ * CRC mode, switched on with SET_CRC: every command and every response or
+ * frame on the wire ends with a big endian CRC-16/CCITT. SEND_FRAME(S) is
+ * followed by an ACK byte. RETRANSMIT makes the W7500 send the response of
+ * the last transaction once more.
+ */
+#define SSED_CRC_LEN 2
+#define SSED_CRC_ACK 0xa5
+#define SSED_CRC_RETRIES 3
+/* Longest sync command, which gets a CRC appended */
+#define SSED_CMD_MAX_LEN 16
+
+/*
+ * Status header, switched on with SET_STATUS: every response starts with
+ * the IR bits, the number of RX frames pending besides the ones returned,
+ * the length of the next one and the TX space, as they were, when the W7500
+ * got the command. Reading it clears the IR bits like GET_IRQ.
+ */
+#define SSED_STATUS_LEN 6
+
+/*
+ * Clock backoff in CRC mode: a window with too many CRC errors lowers the
+ * data clock by 25%, enough clean windows in a row raise it by 12.5% again.
+ */
+#define SSED_CRC_WINDOW 1024
+#define SSED_CRC_BACKOFF_ERRORS 4
+#define SSED_CRC_CLEAN_WINDOWS 16
+
+/* SMI operation still running, reported by GET_SMI_STATUS */
+#define SSED_SMI_BUSY BIT(0)
+/* Worst case time of a SMI operation, if we can't ask for the busy flag */
+#define SSED_SMI_TIME_US 1000
+#define SSED_SMI_POLL_US 50
+#define SSED_SMI_TIMEOUT_US 10000
+
+/*
+ * SET_SMI_REGS: [cmd][phy][count][reg]... starts reading up to
+ * SSED_SMI_REGS_MAX registers of one PHY in a row, the SMI busy flag covers
+ * all of them. GET_SMI_REGS then returns their values, 16 bit each.
+ */
+#define SSED_SMI_REGS_MAX 6
+/* 10/100 PHYs have no 1000BASE-T registers to batch */
+#define SSED_SMI_REGS_100 4
+/* Batch values are good for one read within this time */
+#define SSED_SMI_BATCH_MS 50
+
+/*
+ * RX buffers are single pool pages, the frame is read right behind the
+ * headroom. It is large enough for XDP, so the frame never needs a copy.
+ */
+#define SSED_RX_RING_SIZE 64
+#define SSED_RX_HEADROOM XDP_PACKET_HEADROOM
+#define SSED_RX_MAX_LEN (SKB_WITH_OVERHEAD(PAGE_SIZE) - SSED_RX_HEADROOM - SSED_CRC_LEN)
+
+/*
+ * RECV_FRAMES asks for as many frames as fit into a byte budget. The W7500
+ * answers with a directory: frames still pending afterwards, frame count
+ * and the 2 byte length of each frame. The frames follow back to back in
+ * one read, each lands in its own pool page.
+ */
+#define SSED_RX_BATCH_MAX 16
+#define SSED_RX_BATCH_CMD_LEN 4
+#define SSED_RX_DIR_LEN(count) (2 + 2 * (count))
+
+/* skbs queued by ssed_send(), until they are written to the W7500 */
+#define SSED_TX_RING_SIZE 16
+/*
+ * A full ring at the 100 kHz fallback clock takes about 2 s to drain, one
+ * full frame about 121 ms. Only declare TX stuck well beyond that.
+ */
+#define SSED_TX_TIMEOUT_MS 5000
+/* TX credit of old firmware without GET_TX_FREE: one frame, whatever its size */
+#define SSED_TX_FREE_ONE UINT_MAX
+
+/* SEND_FRAME header: command and the 2 byte frame length */
+#define SSED_TX_FRAME_HDR_LEN 3
+
+/*
+ * SEND_FRAMES burst: a header with command, frame count and length of the
+ * records, followed by the records, each a 2 byte length and the frame.
+ */
+#define SSED_TX_BATCH_MAX SSED_TX_RING_SIZE
+#define SSED_TX_BATCH_HDR_LEN 4
+#define SSED_TX_RECORD_HDR_LEN 2
+
+/*
+ * Transfers of a TX message: the header, per frame a record header, the
+ * linear part, the fragments and the padding, and the CRC and ACK. A burst
+ * of linear frames always fits, one frame with all fragments too.
+ */
+#define SSED_TX_FRAME_XFERS(nr_frags) (3 + (nr_frags))
+
+/*
+ * SEND_RECV_FRAME: command, TX frame length and the RX space of the window.
+ * After the turnaround the TX frame goes out, while the W7500 clocks back a
+ * window with the length and the data of its next RX frame. The window is a
+ * full frame, or just the next frame, if the status header told its length.
+ * Length 0 means no frame is pending, SSED_DUPLEX_RX_LATER one too long
+ * for the window, which stays for RECV_FRAME(S). In CRC mode both
+ * directions end with their CRC and a NAKed transaction keeps the RX frame
+ * as well.
+ */
+#define SSED_TX_DUPLEX_HDR_LEN 5
+#define SSED_DUPLEX_LEN_LEN 2
+#define SSED_DUPLEX_RX_MAX ETH_FRAME_LEN
+#define SSED_DUPLEX_RX_LATER 0xffff
+#define SSED_TX_MAX_XFERS (1 + 3 * SSED_TX_BATCH_MAX + MAX_SKB_FRAGS + 2)
+
+/*
+ * Every command is sent as one spi_message. The W7500 still expects CS to
+ * toggle between the command and its data or response, these are the gaps
+ * it needs with CS deasserted.
+ */
+#define SSED_CS_GAP(us) { .value = (us), .unit = SPI_DELAY_UNIT_USECS }
+/* A zero USECS delay means 10us to the SPI core, so use NSECS for no gap */
+#define SSED_CS_NO_GAP { .value = 0, .unit = SPI_DELAY_UNIT_NSECS }
+
+/* Gap between a command and its response, upper bound for the calibration */
+#define SSED_TURNAROUND_US 25
+#define SSED_TURNAROUND_MAX_US 1000
+/* ECHOs, which must all come back right, before a turnaround counts as good */
+#define SSED_CALIB_ROUNDS 16
+
+/*
+ * The devicetree clock is the slow clock for configuration and SMI commands.
+ * Frame data runs at the fast clock, which is doubled from it, until ECHO
+ * fails or this limit is reached.
+ */
+#define SSED_DATA_HZ_MAX 32000000
+#define SSED_HZ_MIN 10000
+
+static unsigned int rx_budget = NAPI_POLL_WEIGHT;
+module_param(rx_budget, uint, 0444);
+MODULE_PARM_DESC(rx_budget, "Max. number of frames passed to the stack per poll (1-64)");
+
+static bool crc = true;
+module_param(crc, bool, 0444);
+MODULE_PARM_DESC(crc, "Protect the SPI link with CRCs, if the firmware supports it");
+
+static bool duplex = true;
+module_param(duplex, bool, 0444);
+MODULE_PARM_DESC(duplex, "Read RX frames while sending, if the firmware supports it");
+
+static int debug = -1;
+module_param(debug, int, 0444);
+MODULE_PARM_DESC(debug, "netif_msg level bitmap, see ethtool msglvl (-1 for the default)");
+
+#define SSED_MSG_DEFAULT (NETIF_MSG_DRV | NETIF_MSG_PROBE | NETIF_MSG_LINK)
+/* Levels, which log per frame. While no device has one set, they cost a nop */
+#define SSED_MSG_HOT (NETIF_MSG_INTR | NETIF_MSG_TX_QUEUED | NETIF_MSG_TX_DONE | \
+		      NETIF_MSG_RX_STATUS)
+static DEFINE_STATIC_KEY_FALSE(ssed_msg_hot);
+
+#define ssed_msg(priv, type, fmt, ...)						\
+	do {									\
+		if (static_branch_unlikely(&ssed_msg_hot))			\
+			netif_info(priv, type, (priv)->net, fmt, ##__VA_ARGS__);	\
+	} while (0)
+
+/* Message of the data path, which is in flight */
+enum ssed_sm_state {
+	SSED_SM_IDLE,
+	/* A command, which sleeps, has the bus */
+	SSED_SM_SYNC,
+	SSED_SM_IRQ,
+	SSED_SM_RX_LEN,
+	SSED_SM_RX_DIR,
+	SSED_SM_RX_DATA,
+	SSED_SM_RX_DRAIN,
+	SSED_SM_TX_FREE,
+	SSED_SM_TX,
+	SSED_SM_DUPLEX,
+};
+
+/* Counters are per CPU, so the data path never shares a cache line for them */
+struct ssed_pcpu_stats {
+	u64 rx_packets;
+	u64 rx_bytes;
+	u64 rx_dropped;
+	u64 rx_errors;
+	u64 tx_packets;
+	u64 tx_bytes;
+	u64 tx_dropped;
+	u64 tx_errors;
+	/* SPI level, for ethtool -S */
+	u64 spi_cmds[SSED_NR_CMDS];
+	u64 spi_bytes;
+	u64 spi_overhead_bytes;
+	u64 spi_errors;
+	u64 bus_wait_ns;
+	u64 irq_no_work;
+	u64 crc_errors;
+	u64 crc_retries;
+	u64 clock_changes;
+	u64 xdp_drop;
+	u64 xdp_tx;
+	u64 xdp_redirect;
+	u64 xdp_xmit;
+	struct u64_stats_sync syncp;
+};
+
+/*
+ * Latency histograms in debugfs, bucket n counts the latencies with their
+ * highest bit set at n - 1. The last bucket takes everything from 0.5s on.
+ */
+#define SSED_HIST_BUCKETS 31
+
+struct ssed_hist {
+	atomic_long_t buckets[SSED_HIST_BUCKETS];
+};
+
+enum {
+	/* IRQ to the GET_IRQ message */
+	SSED_HIST_IRQ,
+	/* Waiting for and holding the bus in ssed_bus_lock() */
+	SSED_HIST_BUS_WAIT,
+	SSED_HIST_BUS_HOLD,
+	/* ssed_send() to the frame written to the W7500 */
+	SSED_HIST_TX,
+	/* Start to completion of a message, per opcode */
+	SSED_HIST_CMD,
+	SSED_NR_HISTS = SSED_HIST_CMD + SSED_NR_CMDS,
+};
+
+/* Adds val to a per CPU counter, works from any context */
+#define ssed_stats_add(priv, field, val)					\
+	do {									\
+		struct ssed_pcpu_stats *__stats = get_cpu_ptr((priv)->stats);	\
+		unsigned long __flags;						\
+										\
+		__flags = u64_stats_update_begin_irqsave(&__stats->syncp);	\
+		__stats->field += (val);					\
+		u64_stats_update_end_irqrestore(&__stats->syncp, __flags);	\
+		put_cpu_ptr((priv)->stats);					\
+	} while (0)
+
+struct ssed_rx_buf {
+	struct page *page;
+	u16 len;
+};
+
+/* A frame to send, either an skb from the stack or a frame from XDP */
+struct ssed_tx_buf {
+	struct sk_buff *skb;
+	struct xdp_frame *xdpf;
+};
 
 struct ssed_net {
 	struct net_device *net;
 	struct spi_device *spi;
-	struct work_struct work;
-	struct work_struct xmit_work;
 	struct phy_device *phy;
+	/* Last link state reported by phylib */
+	int link;
 	struct mii_bus *mii_bus;
+	/*
+	 * The PHY ID registers never change, the others come in batches.
+	 * Only touched under the mdio_lock of the MDIO bus.
+	 */
+	u16 smi_id[PHY_MAX_ADDR][2];
+	u32 smi_id_cached[2];
+	int smi_batch_addr;
+	u16 smi_batch[SSED_SMI_REGS_MAX];
+	u8 smi_batch_num;
+	u8 smi_batch_valid;
+	unsigned long smi_batch_expires;
+	/* Serializes the commands, which sleep */
 	struct mutex lock;
-	struct sk_buff *tx_skb;
+	/* Protects the state machine and everything, it owns */
+	spinlock_t sm_lock;
+	enum ssed_sm_state sm_state;
+	wait_queue_head_t sm_wq;
+	unsigned int sync_waiters;
+	bool irq_pending;
+	bool tx_turn;
+	/* Time of the IRQ, the message in flight was started and the bus was taken */
+	u64 irq_ts;
+	u64 sm_ts;
+	u64 bus_ts;
+	/* Preallocated message and DMA safe buffers for the data path commands */
+	struct spi_message sm_msg;
+	struct spi_transfer sm_xfers[2];
+	u8 *sm_cmd;
+	u8 *sm_resp;
+	/* DMA safe buffers for the configuration commands, priv->lock held */
+	u8 *sync_cmd;
+	u8 *sync_resp;
+	/* Transfers of the message in flight, for a retransmission */
+	struct spi_transfer *sm_last_xfers;
+	unsigned int sm_last_num;
+	unsigned int sm_retries;
+	bool sm_retx;
+	/* CRC mode, RETRANSMIT command and clock backoff */
+	bool crc;
+	/* Status header mode, length of the next RX frame it reported */
+	bool status_hdr;
+	u16 rx_next_len;
+	/* RX space of the SEND_RECV_FRAME in flight */
+	u16 duplex_rx_max;
+	u8 *retx_cmd;
+	struct spi_transfer retx_xfer;
+	unsigned int crc_msgs;
+	unsigned int crc_window_errors;
+	unsigned int crc_clean_windows;
+	/* Retries a read, which found no memory */
+	struct timer_list retry_timer;
+	/* Refreshes the TX credit, while the frame sent IRQ is held back */
+	struct timer_list tx_poll_timer;
+	/* Filled by ssed_send() and XDP, drained by the state machine */
+	struct ssed_tx_buf tx_ring[SSED_TX_RING_SIZE];
+	u64 tx_ts[SSED_TX_RING_SIZE];
+	unsigned int tx_head;
+	unsigned int tx_tail;
+	/* Bytes the W7500 can still take */
+	unsigned int tx_free;
+	/* No space in the W7500, wait for the frame sent IRQ */
+	bool tx_blocked;
+	/* Frames and their padded length in flight */
+	unsigned int tx_count;
+	unsigned int tx_frames_len;
+	unsigned int tx_bytes;
+	/* DMA safe buffers and transfers for SEND_FRAME(S) */
+	u8 *tx_hdrs;
+	u8 *tx_pad;
+	/* CRC and ACK of SEND_FRAME(S) in CRC mode */
+	u8 *tx_crc;
+	struct spi_transfer tx_xfers[SSED_TX_MAX_XFERS];
+	struct napi_struct napi;
+	struct page_pool *page_pool;
+	/* Filled by the state machine, drained by the poll function */
+	struct ssed_rx_buf rx_ring[SSED_RX_RING_SIZE];
+	unsigned int rx_head;
+	unsigned int rx_tail;
+	/* DMA safe directory and transfers for RECV_FRAMES */
+	u8 *rx_dir;
+	struct spi_transfer rx_xfers[SSED_RX_BATCH_MAX];
+	/* Buffers of the read in flight, bytes left of a frame we drop */
+	struct page *rx_pages[SSED_RX_BATCH_MAX];
+	unsigned int rx_count;
+	unsigned int rx_left;
+	/* Buffers we got back, but may not return to the pool under sm_lock */
+	struct page *rx_spare[SSED_RX_BATCH_MAX];
+	unsigned int rx_nr_spare;
+	bool rx_pending;
+	struct bpf_prog *xdp_prog;
+	struct xdp_rxq_info xdp_rxq;
+	/*
+	 * XDP frames, which are done, but may not return to their page pool
+	 * under sm_lock. The poll function returns them. Every frame in the TX
+	 * ring has its place reserved by xdp_tx_queued.
+	 */
+	struct xdp_frame *xdp_done[SSED_TX_RING_SIZE];
+	unsigned int xdp_done_head;
+	unsigned int xdp_done_tail;
+	unsigned int xdp_tx_queued;
+	/* Interrupt moderation, set by ethtool or adapted by DIM */
+	u16 rx_usecs;
+	u8 rx_frames;
+	u8 tx_frames;
+	bool rx_dim_enabled;
+	struct dim rx_dim;
+	u16 rx_dim_events;
+	u64 rx_dim_packets;
+	u64 rx_dim_bytes;
+	/* Ordered worker of this device, for the commands which sleep */
+	struct workqueue_struct *wq;
+	struct work_struct coalesce_work;
+	/* CPUs for RX processing, empty for no pinning */
+	struct cpumask rx_cpus;
+	/* Polling mode, if there is no IRQ line */
+	bool irq_poll;
+	struct hrtimer irq_poll_timer;
+	unsigned int irq_poll_us;
+	unsigned int irq_poll_min_us;
+	unsigned int irq_poll_max_us;
+	unsigned int turnaround_us;
+	/* SPI clock of configuration commands and of the data path */
+	u32 ctrl_hz;
+	u32 data_hz;
+	u32 data_hz_max;
+	u32 calibrated_hz;
+	u16 features;
+	u32 msg_enable;
+	struct ssed_pcpu_stats __percpu *stats;
+	struct ssed_hist hists[SSED_NR_HISTS];
+	struct dentry *debugfs;
 };
 
+static void ssed_hist_add(struct ssed_net *priv, unsigned int hist, u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+
+	atomic_long_inc(&priv->hists[hist].buckets[min(fls64(ns), SSED_HIST_BUCKETS - 1)]);
+}
+
+/*
+ * Accounts a message on the wire, which was started at start: its first
+ * command, all bytes clocked and the bytes, which weren't frame data.
+ */
+static void ssed_count_spi(struct ssed_net *priv, u8 cmd, unsigned int bytes,
+			   unsigned int payload, int status, u64 start)
+{
+	struct ssed_pcpu_stats *stats;
+	unsigned long flags;
+
+	trace_ssed_spi_msg(priv->spi, cmd, bytes, status, ktime_get_ns() - start);
+	ssed_hist_add(priv, SSED_HIST_CMD + cmd % SSED_NR_CMDS, start);
+
+	stats = get_cpu_ptr(priv->stats);
+	flags = u64_stats_update_begin_irqsave(&stats->syncp);
+	stats->spi_cmds[cmd % SSED_NR_CMDS]++;
+	stats->spi_bytes += bytes;
+	stats->spi_overhead_bytes += bytes - payload;
+	if (status)
+		stats->spi_errors++;
+	u64_stats_update_end_irqrestore(&stats->syncp, flags);
+	put_cpu_ptr(priv->stats);
+}
+
+static unsigned int ssed_crc_len(struct ssed_net *priv)
+{
+	return priv->crc ? SSED_CRC_LEN : 0;
+}
+
+/* Appends the CRC of the len bytes at data */
+static void ssed_crc_put(u8 *data, unsigned int len)
+{
+	u16 sum = crc_itu_t(0xffff, data, len);
+
+	data[len] = sum >> 8;
+	data[len + 1] = sum;
+}
+
+/* Checks len bytes at data, including their CRC */
+static bool ssed_crc_ok(const u8 *data, unsigned int len)
+{
+	return len >= SSED_CRC_LEN && !crc_itu_t(0xffff, data, len);
+}
+
+static unsigned int ssed_status_len(struct ssed_net *priv)
+{
+	return priv->status_hdr ? SSED_STATUS_LEN : 0;
+}
+
+static void ssed_sm_status(struct ssed_net *priv, const u8 *st, u64 sent);
+static void ssed_sm_resync(struct ssed_net *priv);
+
+static int ssed_read_write_hz(struct ssed_net *priv, u8 *wdata, u8 wlen, u8 *rdata, u8 rlen,
+			      u32 speed_hz)
+{
+	u8 *wbuf = priv->sync_cmd, *rbuf = priv->sync_resp;
+	unsigned int crc_len = ssed_crc_len(priv), st_len = ssed_status_len(priv), retries = 0;
+	unsigned long flags;
+	u64 start;
+	int status;
+	struct spi_transfer xfers[] = {
+		{
+			/* Write out data */
+			.tx_buf = wbuf,
+			.len = wlen + crc_len,
+			.speed_hz = speed_hz,
+			/*
+			 * Small delay, so W7500 can react. The SPI core sleeps
+			 * it away, we don't spin here.
+			 */
+			.cs_change = 1,
+			.cs_change_delay = SSED_CS_GAP(READ_ONCE(priv->turnaround_us)),
+		}, {
+			/* Read back data */
+			.rx_buf = rbuf,
+			.len = st_len + rlen + crc_len,
+			.speed_hz = speed_hz,
+		},
+	};
+
+	/* The caller's buffers may live on the stack, SPI needs DMA safe ones */
+	if (WARN_ON(wlen > SSED_CMD_MAX_LEN || rlen > SSED_CMD_MAX_LEN))
+		return -EINVAL;
+	memcpy(wbuf, wdata, wlen);
+	if (crc_len)
+		ssed_crc_put(wbuf, wlen);
+
+	for (;;) {
+		start = ktime_get_ns();
+		status = spi_sync_transfer(priv->spi, xfers, ARRAY_SIZE(xfers));
+		ssed_count_spi(priv, wbuf[0], xfers[0].len + xfers[1].len, 0, status, start);
+		if (status)
+			return status;
+		if (!crc_len || ssed_crc_ok(rbuf, xfers[1].len))
+			break;
+
+		ssed_stats_add(priv, crc_errors, 1);
+		if (retries++ == SSED_CRC_RETRIES) {
+			/* The IR bits of the lost responses are gone, start over */
+			if (st_len) {
+				spin_lock_irqsave(&priv->sm_lock, flags);
+				ssed_sm_resync(priv);
+				spin_unlock_irqrestore(&priv->sm_lock, flags);
+			}
+			return -EBADMSG;
+		}
+		ssed_stats_add(priv, crc_retries, 1);
+
+		/*
+		 * Asking again would clear the IR bits of the status header
+		 * once more, so fetch the same response again.
+		 */
+		wbuf[0] = RETRANSMIT;
+		ssed_crc_put(wbuf, 1);
+		xfers[0].len = 1 + crc_len;
+	}
+
+	/* We hold the bus, the data path picks the status up, once we let go */
+	if (st_len) {
+		spin_lock_irqsave(&priv->sm_lock, flags);
+		ssed_sm_status(priv, rbuf, start);
+		spin_unlock_irqrestore(&priv->sm_lock, flags);
+	}
+	memcpy(rdata, rbuf + st_len, rlen);
+	return 0;
+}
+
+/* Configuration commands run at the slow clock */
 static int ssed_read_write(struct ssed_net *priv, u8 *wdata, u8 wlen, u8 *rdata, u8 rlen)
 {
-	int status;
+	return ssed_read_write_hz(priv, wdata, wlen, rdata, rlen, READ_ONCE(priv->ctrl_hz));
+}
+
+static void ssed_sm_complete(void *context);
+
+/* Queues a received frame for the NAPI poll function, sm_lock held */
+static void ssed_rx_push(struct ssed_net *priv, struct page *page, u16 len)
+{
+	struct ssed_rx_buf *buf;
+
+	/* Nobody will poll us, if the interface is down */
+	if (!netif_running(priv->net)) {
+		priv->rx_spare[priv->rx_nr_spare++] = page;
+		ssed_stats_add(priv, rx_dropped, 1);
+		return;
+	}
+
+	trace_ssed_rx_frame(priv->spi, len);
+	ssed_msg(priv, rx_status, "Frame with %u bytes received\n", len);
+
+	buf = &priv->rx_ring[priv->rx_head % SSED_RX_RING_SIZE];
+	buf->page = page;
+	buf->len = len;
+	smp_store_release(&priv->rx_head, priv->rx_head + 1);
+}
+
+static unsigned int ssed_rx_space(struct ssed_net *priv)
+{
+	return SSED_RX_RING_SIZE - (priv->rx_head - smp_load_acquire(&priv->rx_tail));
+}
+
+/* Takes a buffer from our spares or the page pool, sm_lock held */
+static struct page *ssed_rx_get_page(struct ssed_net *priv)
+{
+	if (priv->rx_nr_spare)
+		return priv->rx_spare[--priv->rx_nr_spare];
+	return page_pool_dev_alloc_pages(priv->page_pool);
+}
+
+/*
+ * Keeps the buffers of the read in flight from index from on as spares for
+ * the next read. Returning them to the pool isn't allowed with sm_lock held.
+ */
+static void ssed_rx_put_pages(struct ssed_net *priv, unsigned int from)
+{
+	while (priv->rx_count > from)
+		priv->rx_spare[priv->rx_nr_spare++] = priv->rx_pages[--priv->rx_count];
+}
+
+static void ssed_rx_ring_purge(struct ssed_net *priv)
+{
+	struct ssed_rx_buf *buf;
+
+	while (priv->rx_tail != priv->rx_head) {
+		buf = &priv->rx_ring[priv->rx_tail++ % SSED_RX_RING_SIZE];
+		page_pool_put_full_page(priv->page_pool, buf->page, false);
+	}
+}
+
+static unsigned int ssed_tx_buf_len(const struct ssed_tx_buf *buf)
+{
+	return buf->skb ? buf->skb->len : buf->xdpf->len;
+}
+
+/* Frees a frame, which is done with. XDP frames go to the poll function. sm_lock held. */
+static void ssed_tx_buf_free(struct ssed_net *priv, struct ssed_tx_buf *buf, bool sent)
+{
+	if (buf->xdpf) {
+		priv->xdp_done[priv->xdp_done_head % SSED_TX_RING_SIZE] = buf->xdpf;
+		smp_store_release(&priv->xdp_done_head, priv->xdp_done_head + 1);
+	} else if (sent) {
+		dev_consume_skb_any(buf->skb);
+	} else {
+		dev_kfree_skb_any(buf->skb);
+	}
+}
+
+static bool ssed_xdp_done_pending(struct ssed_net *priv)
+{
+	return READ_ONCE(priv->xdp_done_head) != READ_ONCE(priv->xdp_done_tail);
+}
+
+/* Returns the XDP frames, the state machine is done with, to their owners */
+static void ssed_xdp_tx_clean(struct ssed_net *priv)
+{
+	unsigned int tail = priv->xdp_done_tail;
+
+	while (tail != smp_load_acquire(&priv->xdp_done_head))
+		xdp_return_frame(priv->xdp_done[tail++ % SSED_TX_RING_SIZE]);
+	smp_store_release(&priv->xdp_done_tail, tail);
+}
+
+/* Credit after a reset, new firmware is asked for it. sm_lock held. */
+static void ssed_tx_credit_reset(struct ssed_net *priv)
+{
+	priv->tx_free = (priv->features & SSED_FEAT_TX_FREE) ? 0 : SSED_TX_FREE_ONE;
+}
+
+/* Checks, if the W7500 has space for len more bytes, sm_lock held */
+static bool ssed_tx_space(struct ssed_net *priv, unsigned int len)
+{
+	return priv->tx_free >= len;
+}
+
+/*
+ * Takes len bytes of the W7500's space. Old firmware only takes one frame at
+ * a time and the frame sent IRQ gives the space back. sm_lock held.
+ */
+static void ssed_tx_consume(struct ssed_net *priv, unsigned int len)
+{
+	if (priv->features & SSED_FEAT_TX_FREE)
+		priv->tx_free -= len;
+	else
+		priv->tx_free = 0;
+}
+
+/* Appends the CRC over the transfers so far */
+static struct spi_transfer *ssed_tx_add_crc(struct ssed_net *priv, struct spi_transfer *xfer)
+{
+	struct spi_transfer *t;
+	u16 sum = 0xffff;
+
+	for (t = priv->tx_xfers; t != xfer; t++)
+		sum = crc_itu_t(sum, t->tx_buf, t->len);
+	priv->tx_crc[0] = sum >> 8;
+	priv->tx_crc[1] = sum;
+	priv->tx_crc[2] = 0;
+
+	xfer->tx_buf = priv->tx_crc;
+	xfer->len = SSED_CRC_LEN;
+	return xfer + 1;
+}
+
+/* Appends the read of the ACK, which the W7500 sends after the turnaround */
+static struct spi_transfer *ssed_tx_add_ack(struct ssed_net *priv, struct spi_transfer *xfer)
+{
+	xfer[-1].cs_change = 1;
+	xfer[-1].cs_change_delay = (struct spi_delay)SSED_CS_GAP(READ_ONCE(priv->turnaround_us));
+	xfer->rx_buf = priv->tx_crc + SSED_CRC_LEN;
+	xfer->len = 1;
+	return xfer + 1;
+}
+
+/*
+ * Builds the message for the frames from tail on: a SEND_FRAMES burst of as
+ * many frames as the W7500 and the SPI controller can take, or a single
+ * SEND_FRAME. Returns the number of transfers, 0 if the W7500 has no space.
+ * For SEND_RECV_FRAME only the header and the frame are built.
+ */
+static unsigned int ssed_tx_prepare(struct ssed_net *priv, unsigned int tail, unsigned int head,
+				    bool send_recv)
+{
+	/* Bursts need the byte credit, old firmware takes one frame at a time */
+	bool batch = !send_recv && (priv->features & SSED_FEAT_TX_BATCH) &&
+		     (priv->features & SSED_FEAT_TX_FREE) && head - tail > 1;
+	struct spi_transfer *xfer = priv->tx_xfers;
+	u8 *hdr = priv->tx_hdrs + SSED_TX_BATCH_HDR_LEN;
+	/* Leave room for the CRC and ACK */
+	size_t max_size = spi_max_message_size(priv->spi) - (priv->crc ? SSED_CRC_LEN + 1 : 0);
+	unsigned int max_count = batch ? SSED_TX_BATCH_MAX : 1;
+	unsigned int count = 0, frames_len = 0, records_len = 0, bytes = 0, len, nr_frags, i;
+	struct ssed_tx_buf *buf;
+	struct sk_buff *skb;
+	skb_frag_t *frag;
+
+	memset(priv->tx_xfers, 0, sizeof(priv->tx_xfers));
+	xfer->tx_buf = priv->tx_hdrs;
+	if (batch) {
+		xfer->len = SSED_TX_BATCH_HDR_LEN;
+	} else if (send_recv) {
+		/* The W7500 fetches its RX frame meanwhile */
+		xfer->len = SSED_TX_DUPLEX_HDR_LEN;
+		xfer->cs_change = 1;
+		xfer->cs_change_delay = (struct spi_delay)SSED_CS_GAP(READ_ONCE(priv->turnaround_us));
+	} else {
+		xfer->len = SSED_TX_FRAME_HDR_LEN;
+		xfer->cs_change = 1;
+		xfer->cs_change_delay = (struct spi_delay)SSED_CS_NO_GAP;
+	}
+	xfer++;
+
+	while (tail + count != head && count < max_count) {
+		buf = &priv->tx_ring[(tail + count) % SSED_TX_RING_SIZE];
+		skb = buf->skb;
+		len = max_t(unsigned int, ssed_tx_buf_len(buf), ETH_ZLEN);
+		nr_frags = skb ? skb_shinfo(skb)->nr_frags : 0;
+
+		if (SSED_TX_BATCH_HDR_LEN + records_len + SSED_TX_RECORD_HDR_LEN + len > max_size)
+			break;
+		if (!ssed_tx_space(priv, frames_len + len))
+			break;
+		/* Keep room for the CRC and ACK transfers */
+		if (xfer - priv->tx_xfers + SSED_TX_FRAME_XFERS(nr_frags) + 2 > SSED_TX_MAX_XFERS)
+			break;
+
+		if (batch) {
+			hdr[0] = len >> 8;
+			hdr[1] = len;
+			xfer->tx_buf = hdr;
+			xfer->len = SSED_TX_RECORD_HDR_LEN;
+			xfer++;
+			hdr += SSED_TX_RECORD_HDR_LEN;
+			records_len += SSED_TX_RECORD_HDR_LEN;
+		}
+
+		/*
+		 * One transfer per fragment, the SPI core maps each into the
+		 * scatterlist for the controller. Without NETIF_F_HIGHDMA the
+		 * stack never hands us fragments in highmem. XDP frames are
+		 * linear.
+		 */
+		if (!skb) {
+			xfer->tx_buf = buf->xdpf->data;
+			xfer->len = buf->xdpf->len;
+			xfer++;
+		} else if (skb_headlen(skb)) {
+			xfer->tx_buf = skb->data;
+			xfer->len = skb_headlen(skb);
+			xfer++;
+		}
+		for (i = 0; i < nr_frags; i++) {
+			frag = &skb_shinfo(skb)->frags[i];
+			xfer->tx_buf = skb_frag_address(frag);
+			xfer->len = skb_frag_size(frag);
+			xfer++;
+		}
+
+		/* Pad short frames from the zero buffer, no need to copy them */
+		if (ssed_tx_buf_len(buf) < ETH_ZLEN) {
+			xfer->tx_buf = priv->tx_pad;
+			xfer->len = ETH_ZLEN - ssed_tx_buf_len(buf);
+			xfer++;
+		}
+
+		frames_len += len;
+		records_len += len;
+		bytes += ssed_tx_buf_len(buf);
+		count++;
+	}
+
+	if (!count)
+		return 0;
+
+	if (batch) {
+		priv->tx_hdrs[0] = SEND_FRAMES;
+		priv->tx_hdrs[1] = count;
+		priv->tx_hdrs[2] = records_len >> 8;
+		priv->tx_hdrs[3] = records_len;
+	} else {
+		priv->tx_hdrs[0] = SEND_FRAME;
+		priv->tx_hdrs[1] = frames_len >> 8;
+		priv->tx_hdrs[2] = frames_len;
+	}
+	if (send_recv) {
+		priv->tx_hdrs[0] = SEND_RECV_FRAME;
+		priv->tx_hdrs[3] = priv->duplex_rx_max >> 8;
+		priv->tx_hdrs[4] = priv->duplex_rx_max & 0xff;
+	}
+
+	/* One CRC over everything, the W7500 ACKs it after the turnaround */
+	if (priv->crc && !send_recv) {
+		xfer = ssed_tx_add_crc(priv, xfer);
+		xfer = ssed_tx_add_ack(priv, xfer);
+	}
+
+	priv->tx_count = count;
+	priv->tx_frames_len = frames_len;
+	priv->tx_bytes = bytes;
+
+	return xfer - priv->tx_xfers;
+}
+
+/*
+ * Builds a SEND_RECV_FRAME for the frame at tail. The RX window overlays the
+ * TX transfers and lands contiguous in rx_pages[0], its length right before
+ * the headroom ends. rx_xfers[0] covers the window for a RETRANSMIT.
+ * Returns the number of transfers, 0 if the W7500 has no space.
+ */
+static unsigned int ssed_duplex_prepare(struct ssed_net *priv, unsigned int tail,
+					unsigned int head)
+{
+	unsigned int prefix = ssed_status_len(priv) + SSED_DUPLEX_LEN_LEN;
+	u8 *rx = page_address(priv->rx_pages[0]) + SSED_RX_HEADROOM - prefix;
+	unsigned int window = prefix + priv->duplex_rx_max + ssed_crc_len(priv);
+	unsigned int num_xfers, len = 0;
+	struct spi_transfer *xfer, *t;
+
+	num_xfers = ssed_tx_prepare(priv, tail, head, true);
+	if (!num_xfers)
+		return 0;
+
+	xfer = priv->tx_xfers + num_xfers;
+	if (priv->crc)
+		xfer = ssed_tx_add_crc(priv, xfer);
+
+	for (t = priv->tx_xfers + 1; t != xfer; t++) {
+		t->rx_buf = rx + len;
+		len += t->len;
+	}
+	/* Short TX frames leave the rest of the window to a plain read */
+	if (len < window) {
+		xfer->rx_buf = rx + len;
+		xfer->len = window - len;
+		xfer++;
+		len = window;
+	}
+	if (SSED_TX_DUPLEX_HDR_LEN + len + 1 > spi_max_message_size(priv->spi))
+		return 0;
+
+	priv->rx_xfers[0] = (struct spi_transfer) {
+		.rx_buf = rx,
+		.len = len,
+	};
+
+	if (priv->crc)
+		xfer = ssed_tx_add_ack(priv, xfer);
+
+	return xfer - priv->tx_xfers;
+}
+
+static void ssed_tx_ring_purge(struct ssed_net *priv)
+{
+	struct ssed_tx_buf *buf;
+
+	ssed_xdp_tx_clean(priv);
+	while (priv->tx_tail != priv->tx_head) {
+		buf = &priv->tx_ring[priv->tx_tail++ % SSED_TX_RING_SIZE];
+		if (buf->xdpf)
+			xdp_return_frame(buf->xdpf);
+		else
+			dev_kfree_skb(buf->skb);
+		ssed_stats_add(priv, tx_dropped, 1);
+	}
+	/* No XDP frame is left anywhere */
+	priv->xdp_tx_queued = priv->xdp_done_tail;
+	netdev_reset_queue(priv->net);
+}
+
+/*
+ * Data path state machine: the IRQ, ssed_send() and the poll function post
+ * events, the completion of each spi_async() message starts the next one.
+ * Only one message is in flight at a time and none of this ever sleeps.
+ */
+static int ssed_sm_async(struct ssed_net *priv, enum ssed_sm_state state)
+{
+	int status;
+
+	priv->sm_msg.complete = ssed_sm_complete;
+	priv->sm_msg.context = priv;
+
+	priv->sm_state = state;
+	priv->sm_ts = ktime_get_ns();
+	status = spi_async(priv->spi, &priv->sm_msg);
+	if (status)
+		priv->sm_state = SSED_SM_IDLE;
+
+	return status;
+}
+
+static int ssed_sm_submit(struct ssed_net *priv, enum ssed_sm_state state,
+			  struct spi_transfer *xfers, unsigned int num_xfers)
+{
+	u32 speed_hz = READ_ONCE(priv->data_hz);
+	unsigned int i;
+
+	/* Everything on the data path runs at the fast clock */
+	for (i = 0; i < num_xfers; i++)
+		xfers[i].speed_hz = speed_hz;
+
+	spi_message_init_with_transfers(&priv->sm_msg, xfers, num_xfers);
+	priv->sm_last_xfers = xfers;
+	priv->sm_last_num = num_xfers;
+	priv->sm_retries = 0;
+	priv->sm_retx = false;
+
+	return ssed_sm_async(priv, state);
+}
+
+/* Starts the command in sm_cmd, its response goes to rdata */
+static int ssed_sm_cmd(struct ssed_net *priv, enum ssed_sm_state state, unsigned int wlen,
+		       u8 *rdata, unsigned int rlen)
+{
+	struct spi_transfer *xfers = priv->sm_xfers;
+	unsigned int crc_len = ssed_crc_len(priv), st_len = ssed_status_len(priv);
+
+	if (crc_len)
+		ssed_crc_put(priv->sm_cmd, wlen);
+
+	memset(priv->sm_xfers, 0, sizeof(priv->sm_xfers));
+	xfers[0].tx_buf = priv->sm_cmd;
+	xfers[0].len = wlen + crc_len;
+	/* Small delay, so W7500 can react */
+	xfers[0].cs_change = 1;
+	xfers[0].cs_change_delay = (struct spi_delay)SSED_CS_GAP(READ_ONCE(priv->turnaround_us));
+	/* Response buffers have room for the status header in front */
+	xfers[1].rx_buf = rdata - st_len;
+	xfers[1].len = st_len + rlen + crc_len;
+
+	return ssed_sm_submit(priv, state, xfers, ARRAY_SIZE(priv->sm_xfers));
+}
+
+static bool ssed_sm_start_irq(struct ssed_net *priv)
+{
+	ssed_hist_add(priv, SSED_HIST_IRQ, priv->irq_ts);
+
+	/* Read out and clear IRQ */
+	priv->sm_cmd[0] = GET_IRQ;
+	return !ssed_sm_cmd(priv, SSED_SM_IRQ, 1, priv->sm_resp, 1);
+}
+
+/* Acts on the IR bits from GET_IRQ or a status header */
+static void ssed_sm_irq_bits(struct ssed_net *priv, u8 ir)
+{
+	/* The PHY link changed, phylib reads the PHY from its own work */
+	if ((ir & 0x20) && priv->phy)
+		phy_mac_interrupt(priv->phy);
+	if (ir & 0x10) {
+		ssed_msg(priv, intr, "Frame send\n");
+		/* Old firmware takes the next frame, once the last one is out */
+		if (!(priv->features & SSED_FEAT_TX_FREE))
+			priv->tx_free = SSED_TX_FREE_ONE;
+		priv->tx_blocked = false;
+	}
+	if (ir & 0x04) {
+		ssed_msg(priv, intr, "Frame reveived\n");
+		priv->rx_pending = true;
+	}
+
+	/* Poll fast while frames flow, back off while the W7500 is idle */
+	if (priv->irq_poll) {
+		unsigned int min_us = READ_ONCE(priv->irq_poll_min_us);
+		unsigned int max_us = READ_ONCE(priv->irq_poll_max_us);
+
+		if (ir & (0x20 | 0x10 | 0x04))
+			WRITE_ONCE(priv->irq_poll_us, min_us);
+		else
+			WRITE_ONCE(priv->irq_poll_us, clamp(priv->irq_poll_us * 2, min_us, max_us));
+	}
+}
+
+static void ssed_sm_irq_done(struct ssed_net *priv, int status)
+{
+	u8 ir = priv->sm_resp[0];
+
+	if (status)
+		return;
+
+	if (!(ir & (0x20 | 0x10 | 0x04)))
+		ssed_stats_add(priv, irq_no_work, 1);
+
+	trace_ssed_irq(priv->spi, ir);
+	ssed_sm_irq_bits(priv, ir);
+}
+
+/*
+ * Takes the status header of a response, which was sent at time sent.
+ * It answers an IRQ, which came before that. sm_lock held.
+ */
+static void ssed_sm_status(struct ssed_net *priv, const u8 *st, u64 sent)
+{
+	if (priv->irq_pending && priv->irq_ts <= sent) {
+		ssed_hist_add(priv, SSED_HIST_IRQ, priv->irq_ts);
+		priv->irq_pending = false;
+	}
+
+	if (st[0])
+		trace_ssed_irq(priv->spi, st[0]);
+	ssed_sm_irq_bits(priv, st[0]);
+	priv->rx_pending = st[1];
+	priv->rx_next_len = (st[2] << 8) | st[3];
+	if (priv->features & SSED_FEAT_TX_FREE) {
+		priv->tx_free = (st[4] << 8) | st[5];
+		priv->tx_blocked = false;
+	}
+}
+
+/* Status header of the message, which just completed */
+static const u8 *ssed_sm_status_hdr(struct ssed_net *priv)
+{
+	switch (priv->sm_state) {
+	case SSED_SM_IRQ:
+	case SSED_SM_RX_LEN:
+	case SSED_SM_RX_DIR:
+	case SSED_SM_TX_FREE:
+		return priv->sm_xfers[1].rx_buf;
+	case SSED_SM_DUPLEX:
+		return priv->rx_xfers[0].rx_buf;
+	default:
+		return NULL;
+	}
+}
+
+static bool ssed_sm_start_rx(struct ssed_net *priv)
+{
+	bool batch = priv->features & SSED_FEAT_RX_BATCH;
+	unsigned int max_count, bytes;
+
+	if (!priv->rx_pending)
+		return false;
+
+	/* No space left, the poll function kicks us again */
+	max_count = min_t(unsigned int, ssed_rx_space(priv), batch ? SSED_RX_BATCH_MAX : 1);
+	if (!max_count)
+		return false;
+
+	/* Get the buffers before asking for the frames, so we never have to drop them */
+	for (priv->rx_count = 0; priv->rx_count < max_count; priv->rx_count++) {
+		priv->rx_pages[priv->rx_count] = ssed_rx_get_page(priv);
+		if (!priv->rx_pages[priv->rx_count])
+			break;
+	}
+	if (!priv->rx_count) {
+		/* Out of memory, keep the frames in the W7500 for now */
+		mod_timer(&priv->retry_timer, jiffies + 1);
+		return false;
+	}
+
+	if (batch) {
+		bytes = min_t(size_t, priv->rx_count * (SSED_RX_MAX_LEN + ssed_crc_len(priv)),
+			      spi_max_message_size(priv->spi));
+		bytes = min(bytes, 0xffffU);
+		priv->sm_cmd[0] = RECV_FRAMES;
+		priv->sm_cmd[1] = bytes >> 8;
+		priv->sm_cmd[2] = bytes;
+		priv->sm_cmd[3] = priv->rx_count;
+		if (!ssed_sm_cmd(priv, SSED_SM_RX_DIR, SSED_RX_BATCH_CMD_LEN, priv->rx_dir,
+				 SSED_RX_DIR_LEN(priv->rx_count)))
+			return true;
+	} else {
+		/* Get length of received frame */
+		priv->sm_cmd[0] = RECV_FRAME;
+		if (!ssed_sm_cmd(priv, SSED_SM_RX_LEN, 1, priv->sm_resp, 2))
+			return true;
+	}
+
+	ssed_rx_put_pages(priv, 0);
+	priv->rx_pending = false;
+	return false;
+}
+
+/* Returns true, if the next message of the read is in flight */
+static bool ssed_sm_rx_len_done(struct ssed_net *priv, int status)
+{
+	u16 len = (priv->sm_resp[0] << 8) | priv->sm_resp[1];
+	struct spi_transfer *xfer = &priv->rx_xfers[0];
+	enum ssed_sm_state state = SSED_SM_RX_DATA;
+	unsigned int crc_len = ssed_crc_len(priv);
+
+	/* W7500 is drained */
+	if (status || !len)
+		goto out;
+
+	/* Read out package over SPI */
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->rx_buf = page_address(priv->rx_pages[0]) + SSED_RX_HEADROOM;
+	xfer->len = len + crc_len;
+	if (len > SSED_RX_MAX_LEN) {
+		/* Doesn't fit into a buffer, read it out in chunks and drop it */
+		dev_err_ratelimited(&priv->spi->dev, "Frame with %d bytes too long, drop it\n", len);
+		ssed_stats_add(priv, rx_errors, 1);
+		priv->rx_left = len + crc_len;
+		xfer->len = SSED_RX_MAX_LEN;
+		state = SSED_SM_RX_DRAIN;
+	}
+
+	if (!ssed_sm_submit(priv, state, xfer, 1))
+		return true;
+out:
+	ssed_rx_put_pages(priv, 0);
+	priv->rx_pending = false;
+	return false;
+}
+
+/* Returns true, if the next chunk of the too long frame is in flight */
+static bool ssed_sm_rx_drain_done(struct ssed_net *priv, int status)
+{
+	struct spi_transfer *xfer = &priv->rx_xfers[0];
+
+	priv->rx_left -= xfer->len;
+	if (!status && priv->rx_left) {
+		xfer->len = min_t(unsigned int, priv->rx_left, SSED_RX_MAX_LEN);
+		if (!ssed_sm_submit(priv, SSED_SM_RX_DRAIN, xfer, 1))
+			return true;
+		status = -EIO;
+	}
+
+	ssed_rx_put_pages(priv, 0);
+	if (status)
+		priv->rx_pending = false;
+	return false;
+}
+
+/* Returns true, if the frames of the directory are in flight */
+static bool ssed_sm_rx_dir_done(struct ssed_net *priv, int status)
+{
+	unsigned int bytes = (priv->sm_cmd[1] << 8) | priv->sm_cmd[2];
+	unsigned int count = priv->rx_dir[1], total = 0, i;
+	unsigned int crc_len = ssed_crc_len(priv);
+	u16 len;
+
+	if (status)
+		goto out;
+
+	/*
+	 * Check the directory, before we read anything into our buffers.
+	 * If we don't read the frames, the W7500 discards them.
+	 */
+	for (i = 0; i < count && i < priv->rx_count; i++) {
+		len = (priv->rx_dir[2 + 2 * i] << 8) | priv->rx_dir[3 + 2 * i];
+		if (!len || len > SSED_RX_MAX_LEN)
+			break;
+		total += len + crc_len;
+
+		priv->rx_xfers[i] = (struct spi_transfer) {
+			.rx_buf = page_address(priv->rx_pages[i]) + SSED_RX_HEADROOM,
+			.len = len + crc_len,
+		};
+	}
+	if (i != count || total > bytes) {
+		dev_err_ratelimited(&priv->spi->dev, "Bad RECV_FRAMES directory, drop %u frames\n",
+				    count);
+		ssed_stats_add(priv, rx_errors, count);
+		goto out;
+	}
+
+	priv->rx_pending = priv->rx_dir[0];
+	ssed_rx_put_pages(priv, count);
+	if (!count)
+		return false;
+
+	if (!ssed_sm_submit(priv, SSED_SM_RX_DATA, priv->rx_xfers, count))
+		return true;
+out:
+	ssed_rx_put_pages(priv, 0);
+	priv->rx_pending = false;
+	return false;
+}
+
+/* Returns true, if frames were queued for the poll function */
+static bool ssed_sm_rx_data_done(struct ssed_net *priv, int status)
+{
+	unsigned int i;
+
+	if (status) {
+		ssed_rx_put_pages(priv, 0);
+		priv->rx_pending = false;
+		return false;
+	}
+
+	for (i = 0; i < priv->rx_count; i++)
+		ssed_rx_push(priv, priv->rx_pages[i], priv->rx_xfers[i].len - ssed_crc_len(priv));
+	priv->rx_count = 0;
+
+	return true;
+}
+
+/*
+ * Frees count frames from the tail on, sent or not, and wakes the queue,
+ * once there is space again. sm_lock held.
+ */
+static void ssed_tx_complete(struct ssed_net *priv, unsigned int count, bool sent)
+{
+	unsigned int tail = priv->tx_tail, pkts = 0, bytes = 0, i;
+	struct ssed_tx_buf *buf;
+
+	for (i = 0; i < count; i++) {
+		buf = &priv->tx_ring[tail++ % SSED_TX_RING_SIZE];
+		/* Only skbs count for BQL */
+		if (buf->skb) {
+			pkts++;
+			bytes += buf->skb->len;
+		}
+		ssed_tx_buf_free(priv, buf, sent);
+	}
+	netdev_completed_queue(priv->net, pkts, bytes);
+	smp_store_release(&priv->tx_tail, tail);
+
+	/* Pairs with the barrier in ssed_send() */
+	smp_mb();
+	if (netif_queue_stopped(priv->net) &&
+	    READ_ONCE(priv->tx_head) - tail < SSED_TX_RING_SIZE)
+		netif_wake_queue(priv->net);
+}
+
+/* Drops the frames up to head without sending them */
+static void ssed_sm_tx_drop(struct ssed_net *priv, unsigned int head)
+{
+	ssed_stats_add(priv, tx_dropped, head - priv->tx_tail);
+	ssed_tx_complete(priv, head - priv->tx_tail, false);
+}
+
+/* Waits for the frame sent IRQ, which tx-frames > 1 may hold back for good */
+static void ssed_sm_tx_block(struct ssed_net *priv)
+{
+	priv->tx_blocked = true;
+	if (READ_ONCE(priv->tx_frames) > 1)
+		mod_timer(&priv->tx_poll_timer, jiffies + msecs_to_jiffies(SSED_TX_POLL_MS));
+}
+
+static bool ssed_sm_start_tx(struct ssed_net *priv)
+{
+	unsigned int tail = priv->tx_tail, head = smp_load_acquire(&priv->tx_head);
+	unsigned int num_xfers;
+
+	if (tail == head)
+		return false;
+	/* No link, the W7500 could only throw the frames away */
+	if (!netif_carrier_ok(priv->net)) {
+		ssed_sm_tx_drop(priv, head);
+		return false;
+	}
+	if (priv->tx_blocked)
+		return false;
+
+	num_xfers = ssed_tx_prepare(priv, tail, head, false);
+	if (!num_xfers) {
+		/*
+		 * Ask the W7500 for its space, old firmware waits for the frame
+		 * sent IRQ. With status headers the next response brings it.
+		 */
+		if ((priv->features & SSED_FEAT_TX_FREE) && !priv->status_hdr) {
+			priv->sm_cmd[0] = GET_TX_FREE;
+			if (!ssed_sm_cmd(priv, SSED_SM_TX_FREE, 1, priv->sm_resp, 2))
+				return true;
+		}
+		ssed_sm_tx_block(priv);
+		return false;
+	}
+
+	return !ssed_sm_submit(priv, SSED_SM_TX, priv->tx_xfers, num_xfers);
+}
+
+static void ssed_sm_tx_free_done(struct ssed_net *priv, int status)
+{
+	struct ssed_tx_buf *buf = &priv->tx_ring[priv->tx_tail % SSED_TX_RING_SIZE];
+
+	if (!status)
+		priv->tx_free = (priv->sm_resp[0] << 8) | priv->sm_resp[1];
+
+	/* Still no space, wait for the frame sent IRQ */
+	if (status || !ssed_tx_space(priv, max_t(unsigned int, ssed_tx_buf_len(buf), ETH_ZLEN)))
+		ssed_sm_tx_block(priv);
+}
+
+static void ssed_sm_tx_done(struct ssed_net *priv, int status)
+{
+	unsigned int tail = priv->tx_tail, i;
+
+	if (status) {
+		ssed_stats_add(priv, tx_errors, priv->tx_count);
+	} else {
+		ssed_tx_consume(priv, priv->tx_frames_len);
+		ssed_stats_add(priv, tx_packets, priv->tx_count);
+		ssed_stats_add(priv, tx_bytes, priv->tx_bytes);
+	}
+
+	for (i = 0; i < priv->tx_count; i++)
+		ssed_hist_add(priv, SSED_HIST_TX, priv->tx_ts[(tail + i) % SSED_TX_RING_SIZE]);
+
+	trace_ssed_tx_done(priv->spi, priv->tx_count, priv->tx_bytes, status);
+	ssed_msg(priv, tx_done, "%u packets were transfered\n", priv->tx_count);
+
+	/* The W7500 has copies now, free the frames in one go */
+	ssed_tx_complete(priv, priv->tx_count, !status);
+}
+
+/* Sends the next frame and reads one in the same transaction, if both are waiting */
+static bool ssed_sm_start_duplex(struct ssed_net *priv)
+{
+	unsigned int tail = priv->tx_tail, head = smp_load_acquire(&priv->tx_head);
+	unsigned int num_xfers;
+
+	if (!duplex || !(priv->features & SSED_FEAT_DUPLEX) || !priv->rx_pending ||
+	    tail == head || priv->tx_blocked || !netif_carrier_ok(priv->net) ||
+	    !ssed_rx_space(priv))
+		return false;
+	/* Known to be too long for the window */
+	if (priv->status_hdr && priv->rx_next_len > SSED_DUPLEX_RX_MAX)
+		return false;
+	/* A SEND_FRAMES burst moves more than one frame per transaction */
+	if (head - tail > 1 && (priv->features & SSED_FEAT_TX_BATCH) &&
+	    (priv->features & SSED_FEAT_TX_FREE))
+		return false;
+	/* The status header tells the length, then the window fits the frame */
+	priv->duplex_rx_max = priv->status_hdr && priv->rx_next_len ? priv->rx_next_len :
+				SSED_DUPLEX_RX_MAX;
+	/*
+	 * The RX window costs as much as the TX frame, if it is shorter.
+	 * Only a TX frame, which covers the window, saves a transaction,
+	 * otherwise the padding read costs more than SEND_FRAME and RECV_FRAME.
+	 */
+	if (max_t(unsigned int, ssed_tx_buf_len(&priv->tx_ring[tail % SSED_TX_RING_SIZE]),
+		  ETH_ZLEN) < priv->duplex_rx_max)
+		return false;
+
+	/* Out of memory, the RX path takes care of it */
+	priv->rx_pages[0] = ssed_rx_get_page(priv);
+	if (!priv->rx_pages[0])
+		return false;
+	priv->rx_count = 1;
+
+	num_xfers = ssed_duplex_prepare(priv, tail, head);
+	if (num_xfers && !ssed_sm_submit(priv, SSED_SM_DUPLEX, priv->tx_xfers, num_xfers))
+		return true;
+
+	ssed_rx_put_pages(priv, 0);
+	return false;
+}
+
+/* Length of the RX frame in the duplex window */
+static u16 ssed_duplex_frame_len(struct ssed_net *priv)
+{
+	const u8 *len = priv->rx_xfers[0].rx_buf + ssed_status_len(priv);
+
+	return (len[0] << 8) | len[1];
+}
+
+/* Bytes of the duplex window the CRC covers */
+static unsigned int ssed_duplex_rx_len(struct ssed_net *priv)
+{
+	u16 len = ssed_duplex_frame_len(priv);
+
+	return ssed_status_len(priv) + SSED_DUPLEX_LEN_LEN +
+	       (len <= priv->duplex_rx_max ? len : 0);
+}
+
+/* Returns true, if a frame came back for the poll function */
+static bool ssed_sm_duplex_done(struct ssed_net *priv, int status)
+{
+	u16 len = ssed_duplex_frame_len(priv);
+
+	ssed_sm_tx_done(priv, status);
+
+	if (!status && len && len != SSED_DUPLEX_RX_LATER) {
+		if (len <= priv->duplex_rx_max) {
+			ssed_rx_push(priv, priv->rx_pages[0], len);
+			priv->rx_count = 0;
+			return true;
+		}
+		dev_err_ratelimited(&priv->spi->dev, "Bad SEND_RECV_FRAME length %u\n", len);
+		ssed_stats_add(priv, rx_errors, 1);
+	}
+
+	/* Frames, which didn't fit, wait for RECV_FRAME(S) */
+	if (!status && !len)
+		priv->rx_pending = false;
+	ssed_rx_put_pages(priv, 0);
+	return false;
+}
+
+/* Starts the next operation, sm_lock held and nothing in flight */
+static void ssed_sm_next(struct ssed_net *priv)
+{
+	bool tx_first;
+
+	priv->sm_state = SSED_SM_IDLE;
+
+	/* Let a command, which sleeps, in before we start the next operation */
+	if (priv->sync_waiters) {
+		wake_up(&priv->sm_wq);
+		return;
+	}
+
+	if (priv->irq_pending) {
+		/*
+		 * With status headers every response answers the IRQ. Most are
+		 * for received frames, so go for them right away.
+		 */
+		if (priv->status_hdr) {
+			priv->rx_pending = true;
+			if (ssed_sm_start_rx(priv))
+				return;
+		}
+		priv->irq_pending = false;
+		if (ssed_sm_start_irq(priv))
+			return;
+	}
+
+	if (ssed_sm_start_duplex(priv))
+		return;
+
+	/* Take turns, so TX and RX don't starve each other */
+	tx_first = priv->tx_turn;
+	priv->tx_turn = !priv->tx_turn;
+	if (tx_first && ssed_sm_start_tx(priv))
+		return;
+	if (ssed_sm_start_rx(priv))
+		return;
+	if (!tx_first && ssed_sm_start_tx(priv))
+		return;
+}
+
+/*
+ * NAPI must be scheduled with BHs disabled in task context, so the softirq
+ * runs right away. SPI completions may run in any context.
+ */
+static void ssed_napi_schedule(struct ssed_net *priv)
+{
+	if (in_task()) {
+		local_bh_disable();
+		napi_schedule(&priv->napi);
+		local_bh_enable();
+	} else {
+		napi_schedule(&priv->napi);
+	}
+}
+
+/* Counts the message, which just completed */
+static void ssed_sm_count(struct ssed_net *priv, int status)
+{
+	unsigned int bytes = priv->sm_msg.frame_length, payload = 0;
+	u8 cmd;
+
+	switch (priv->sm_state) {
+	case SSED_SM_RX_DATA:
+	case SSED_SM_RX_DRAIN:
+		cmd = 0;
+		payload = bytes;
+		break;
+	case SSED_SM_TX:
+	case SSED_SM_DUPLEX:
+		cmd = priv->tx_hdrs[0];
+		payload = priv->tx_bytes;
+		break;
+	default:
+		cmd = priv->sm_cmd[0];
+		break;
+	}
+	/* Frames go out as they were, responses are asked for with RETRANSMIT */
+	if (priv->sm_retx)
+		cmd = RETRANSMIT;
+
+	ssed_count_spi(priv, cmd, bytes, payload, status, priv->sm_ts);
+}
+
+/* Checks the CRCs of the message, which just completed */
+static bool ssed_sm_crc_ok(struct ssed_net *priv)
+{
+	struct spi_transfer *xfer;
+
+	switch (priv->sm_state) {
+	case SSED_SM_RX_DRAIN:
+		/* Chunks of a frame we drop, its CRC doesn't matter */
+		return true;
+	case SSED_SM_TX:
+		return priv->tx_crc[SSED_CRC_LEN] == SSED_CRC_ACK;
+	case SSED_SM_DUPLEX:
+		return priv->tx_crc[SSED_CRC_LEN] == SSED_CRC_ACK &&
+		       ssed_crc_ok(priv->rx_xfers[0].rx_buf, ssed_duplex_rx_len(priv) + SSED_CRC_LEN);
+	default:
+		list_for_each_entry(xfer, &priv->sm_msg.transfers, transfer_list)
+			if (xfer->rx_buf && !ssed_crc_ok(xfer->rx_buf, xfer->len))
+				return false;
+		return true;
+	}
+}
+
+/*
+ * Asks the W7500 for the responses of the last message once more, frames we
+ * sent go out again as a whole. Returns true, if the retry is in flight.
+ */
+static bool ssed_sm_retransmit(struct ssed_net *priv)
+{
+	enum ssed_sm_state state = priv->sm_state;
+	u32 speed_hz = READ_ONCE(priv->data_hz);
+	bool resend = state == SSED_SM_TX || (state == SSED_SM_DUPLEX &&
+					      priv->tx_crc[SSED_CRC_LEN] != SSED_CRC_ACK);
+	struct spi_transfer *xfer;
+	unsigned int i;
+
+	if (priv->sm_retries == SSED_CRC_RETRIES)
+		return false;
+	priv->sm_retries++;
+	priv->sm_retx = !resend;
+	ssed_stats_add(priv, crc_retries, 1);
+
+	spi_message_init(&priv->sm_msg);
+	if (!resend) {
+		xfer = &priv->retx_xfer;
+		xfer->cs_change_delay = (struct spi_delay)SSED_CS_GAP(READ_ONCE(priv->turnaround_us));
+		xfer->speed_hz = speed_hz;
+		spi_message_add_tail(xfer, &priv->sm_msg);
+	}
+	if (!resend && state == SSED_SM_DUPLEX) {
+		/* The frame was ACKed, only the RX window comes again */
+		priv->rx_xfers[0].speed_hz = speed_hz;
+		spi_message_add_tail(&priv->rx_xfers[0], &priv->sm_msg);
+	} else {
+		for (i = 0; i < priv->sm_last_num; i++) {
+			xfer = &priv->sm_last_xfers[i];
+			if (!resend && !xfer->rx_buf)
+				continue;
+			/* The clock may just have been lowered */
+			xfer->speed_hz = speed_hz;
+			spi_message_add_tail(xfer, &priv->sm_msg);
+		}
+	}
+
+	if (!ssed_sm_async(priv, state))
+		return true;
+	priv->sm_state = state;
+	return false;
+}
+
+/*
+ * Gave up on a message, the W7500 may have lost an IRQ flag or frames on the
+ * way. Ask for everything again, nothing is lost by asking once too often.
+ */
+static void ssed_sm_resync(struct ssed_net *priv)
+{
+	dev_warn_ratelimited(&priv->spi->dev, "CRC errors persist, resynchronizing\n");
+
+	if (!priv->irq_pending) {
+		priv->irq_pending = true;
+		priv->irq_ts = ktime_get_ns();
+	}
+	priv->rx_pending = true;
+	ssed_tx_credit_reset(priv);
+	priv->tx_blocked = false;
+}
+
+/*
+ * Lowers the data clock, if a window of messages sees too many CRC errors,
+ * and raises it again towards the calibrated clock after enough clean ones.
+ */
+static void ssed_crc_account(struct ssed_net *priv, bool error)
+{
+	u32 hz = priv->data_hz;
+
+	priv->crc_msgs++;
+	if (error)
+		priv->crc_window_errors++;
+
+	if (priv->crc_window_errors >= SSED_CRC_BACKOFF_ERRORS) {
+		/* Don't wait for the end of the window */
+		hz = max(hz - hz / 4, READ_ONCE(priv->ctrl_hz));
+		priv->crc_clean_windows = 0;
+	} else if (priv->crc_msgs < SSED_CRC_WINDOW) {
+		return;
+	} else if (priv->crc_window_errors) {
+		priv->crc_clean_windows = 0;
+	} else if (++priv->crc_clean_windows == SSED_CRC_CLEAN_WINDOWS) {
+		hz = min(hz + hz / 8, READ_ONCE(priv->data_hz_max));
+		priv->crc_clean_windows = 0;
+	}
+	priv->crc_msgs = 0;
+	priv->crc_window_errors = 0;
+
+	if (hz == priv->data_hz)
+		return;
+
+	WRITE_ONCE(priv->data_hz, hz);
+	ssed_stats_add(priv, clock_changes, 1);
+	netif_info(priv, hw, priv->net, "SPI data clock now %u Hz\n", hz);
+}
+
+static void ssed_sm_complete(void *context)
+{
+	struct ssed_net *priv = context;
+	int status = priv->sm_msg.status;
+	bool chained = false, rx_done = false, resync = false;
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->sm_lock, flags);
+	ssed_sm_count(priv, status);
+	if (priv->crc && !status) {
+		bool ok = ssed_sm_crc_ok(priv);
+
+		ssed_crc_account(priv, !ok);
+		if (!ok) {
+			ssed_stats_add(priv, crc_errors, 1);
+			if (ssed_sm_retransmit(priv)) {
+				spin_unlock_irqrestore(&priv->sm_lock, flags);
+				return;
+			}
+			status = -EBADMSG;
+			resync = true;
+		}
+	}
+	if (priv->status_hdr && !status && ssed_sm_status_hdr(priv))
+		ssed_sm_status(priv, ssed_sm_status_hdr(priv), priv->sm_ts);
+	switch (priv->sm_state) {
+	case SSED_SM_IRQ:
+		ssed_sm_irq_done(priv, status);
+		break;
+	case SSED_SM_RX_LEN:
+		chained = ssed_sm_rx_len_done(priv, status);
+		break;
+	case SSED_SM_RX_DRAIN:
+		chained = ssed_sm_rx_drain_done(priv, status);
+		break;
+	case SSED_SM_RX_DIR:
+		chained = ssed_sm_rx_dir_done(priv, status);
+		break;
+	case SSED_SM_RX_DATA:
+		rx_done = ssed_sm_rx_data_done(priv, status);
+		break;
+	case SSED_SM_TX_FREE:
+		ssed_sm_tx_free_done(priv, status);
+		break;
+	case SSED_SM_TX:
+		ssed_sm_tx_done(priv, status);
+		break;
+	case SSED_SM_DUPLEX:
+		rx_done = ssed_sm_duplex_done(priv, status);
+		break;
+	default:
+		break;
+	}
+	if (resync)
+		ssed_sm_resync(priv);
+	if (!chained)
+		ssed_sm_next(priv);
+	spin_unlock_irqrestore(&priv->sm_lock, flags);
+
+	if (rx_done || ssed_xdp_done_pending(priv))
+		ssed_napi_schedule(priv);
+}
+
+/* Starts the next operation, if the data path is idle */
+static void ssed_sm_kick(struct ssed_net *priv, bool irq)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->sm_lock, flags);
+	if (irq && !priv->irq_pending) {
+		priv->irq_pending = true;
+		priv->irq_ts = ktime_get_ns();
+	}
+	if (priv->sm_state == SSED_SM_IDLE)
+		ssed_sm_next(priv);
+	spin_unlock_irqrestore(&priv->sm_lock, flags);
+
+	/* Frames dropped without link */
+	if (ssed_xdp_done_pending(priv))
+		ssed_napi_schedule(priv);
+}
+
+static void ssed_retry(struct timer_list *t)
+{
+	struct ssed_net *priv = from_timer(priv, t, retry_timer);
+
+	ssed_sm_kick(priv, false);
+}
+
+static void ssed_tx_poll(struct timer_list *t)
+{
+	struct ssed_net *priv = from_timer(priv, t, tx_poll_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->sm_lock, flags);
+	priv->tx_blocked = false;
+	spin_unlock_irqrestore(&priv->sm_lock, flags);
+	/* GET_TX_FREE or, with status headers, any response brings the credit */
+	ssed_sm_kick(priv, priv->status_hdr);
+}
+
+static bool ssed_bus_claim(struct ssed_net *priv)
+{
+	unsigned long flags;
+	bool claimed;
+
+	spin_lock_irqsave(&priv->sm_lock, flags);
+	claimed = priv->sm_state == SSED_SM_IDLE;
+	if (claimed) {
+		priv->sm_state = SSED_SM_SYNC;
+		priv->sync_waiters--;
+	}
+	spin_unlock_irqrestore(&priv->sm_lock, flags);
+
+	return claimed;
+}
+
+/*
+ * Takes the bus from the data path for commands, which sleep. Waits for the
+ * operation in flight and keeps the state machine from starting the next.
+ */
+static void ssed_bus_lock(struct ssed_net *priv)
+{
+	u64 start = ktime_get_ns();
+	unsigned long flags;
+
+	mutex_lock(&priv->lock);
+	spin_lock_irqsave(&priv->sm_lock, flags);
+	priv->sync_waiters++;
+	spin_unlock_irqrestore(&priv->sm_lock, flags);
+
+	wait_event(priv->sm_wq, ssed_bus_claim(priv));
+	priv->bus_ts = ktime_get_ns();
+	ssed_stats_add(priv, bus_wait_ns, priv->bus_ts - start);
+	ssed_hist_add(priv, SSED_HIST_BUS_WAIT, start);
+}
+
+/* Hands the bus back, the data path catches up on what happened meanwhile */
+static void ssed_bus_unlock(struct ssed_net *priv)
+{
+	unsigned long flags;
+
+	ssed_hist_add(priv, SSED_HIST_BUS_HOLD, priv->bus_ts);
+	spin_lock_irqsave(&priv->sm_lock, flags);
+	ssed_sm_next(priv);
+	spin_unlock_irqrestore(&priv->sm_lock, flags);
+	mutex_unlock(&priv->lock);
+}
+
+/*
+ * Writes a command without response, bus held. In CRC mode the W7500 ACKs
+ * it after the turnaround like SEND_FRAME and drops it on a CRC error, so
+ * it goes out again then.
+ */
+static int ssed_write_locked(struct ssed_net *priv, const u8 *data, unsigned int len)
+{
+	u8 *buf = priv->sync_cmd, *ack = priv->sync_resp;
+	struct spi_transfer xfers[] = {
+		{
+			.tx_buf = buf,
+			.len = len,
+			.speed_hz = READ_ONCE(priv->ctrl_hz),
+		}, {
+			.rx_buf = ack,
+			.len = 1,
+			.speed_hz = READ_ONCE(priv->ctrl_hz),
+		},
+	};
+	unsigned int retries = 0;
+	int status;
+	u64 start;
+
+	if (WARN_ON(len > SSED_CMD_MAX_LEN))
+		return -EINVAL;
+	memcpy(buf, data, len);
+
+	if (!priv->crc) {
+		start = ktime_get_ns();
+		status = spi_sync_transfer(priv->spi, xfers, 1);
+		ssed_count_spi(priv, data[0], len, 0, status, start);
+		return status;
+	}
+
+	ssed_crc_put(buf, len);
+	xfers[0].len = len + SSED_CRC_LEN;
+	xfers[0].cs_change = 1;
+	xfers[0].cs_change_delay = (struct spi_delay)SSED_CS_GAP(READ_ONCE(priv->turnaround_us));
+
+	for (;;) {
+		start = ktime_get_ns();
+		status = spi_sync_transfer(priv->spi, xfers, ARRAY_SIZE(xfers));
+		ssed_count_spi(priv, data[0], xfers[0].len + xfers[1].len, 0, status, start);
+		if (status)
+			return status;
+		if (*ack == SSED_CRC_ACK)
+			return 0;
+
+		ssed_stats_add(priv, crc_errors, 1);
+		if (retries++ == SSED_CRC_RETRIES)
+			return -EBADMSG;
+		ssed_stats_add(priv, crc_retries, 1);
+	}
+}
+
+static int ssed_write(struct ssed_net *priv, u8 *data, unsigned int len)
+{
+	int status;
+
+	ssed_bus_lock(priv);
+	status = ssed_write_locked(priv, data, len);
+	ssed_bus_unlock(priv);
+
+	return status;
+}
+
+static void ssed_read_features(struct ssed_net *priv)
+{
+	u8 cmd = GET_FEATURES, resp[2];
+	int status;
+
+	ssed_bus_lock(priv);
+	status = ssed_read_write(priv, &cmd, 1, resp, sizeof(resp));
+	ssed_bus_unlock(priv);
+
+	priv->features = status ? 0 : (resp[0] << 8) | resp[1];
+	/* Firmware without GET_FEATURES leaves MISO floating */
+	if (priv->features == 0xffff)
+		priv->features = 0;
+
+	dev_info(&priv->spi->dev, "Firmware features: 0x%04x\n", priv->features);
+}
+
+/*
+ * Switches the link to CRC mode, if the firmware supports it. SET_CRC itself
+ * goes out plain, reading the features again with CRCs proves, it arrived.
+ */
+static void ssed_crc_init(struct ssed_net *priv)
+{
+	u8 cmd[2] = { SET_CRC, 1 }, resp[2];
+	int status;
+
+	if (!crc || !(priv->features & SSED_FEAT_CRC))
+		return;
+
+	status = ssed_write(priv, cmd, sizeof(cmd));
+	if (!status) {
+		priv->crc = true;
+		cmd[0] = GET_FEATURES;
+		ssed_bus_lock(priv);
+		status = ssed_read_write(priv, cmd, 1, resp, sizeof(resp));
+		ssed_bus_unlock(priv);
+	}
+	if (status || ((resp[0] << 8) | resp[1]) != priv->features) {
+		dev_err(&priv->spi->dev, "Error switching to CRC mode\n");
+		/*
+		 * The W7500 may be in CRC mode anyway, switch it off with a
+		 * CRC. Without CRC mode it ignores the bytes behind the command.
+		 */
+		priv->crc = true;
+		cmd[0] = SET_CRC;
+		cmd[1] = 0;
+		ssed_write(priv, cmd, sizeof(cmd));
+		priv->crc = false;
+		return;
+	}
+
+	/* RETRANSMIT never changes, so its CRC is computed once */
+	priv->retx_cmd[0] = RETRANSMIT;
+	ssed_crc_put(priv->retx_cmd, 1);
+	priv->retx_xfer.tx_buf = priv->retx_cmd;
+	priv->retx_xfer.len = 1 + SSED_CRC_LEN;
+	priv->retx_xfer.cs_change = 1;
+
+	dev_info(&priv->spi->dev, "CRC mode on\n");
+}
+
+/*
+ * Switches on the status header, if the firmware supports it. Like for the
+ * CRC mode, reading the features with the header proves, it arrived.
+ */
+static void ssed_status_init(struct ssed_net *priv)
+{
+	u8 cmd[2] = { SET_STATUS, 1 }, resp[2];
+	int status;
+
+	if (!(priv->features & SSED_FEAT_STATUS))
+		return;
+
+	status = ssed_write(priv, cmd, sizeof(cmd));
+	if (!status) {
+		priv->status_hdr = true;
+		cmd[0] = GET_FEATURES;
+		ssed_bus_lock(priv);
+		status = ssed_read_write(priv, cmd, 1, resp, sizeof(resp));
+		ssed_bus_unlock(priv);
+	}
+	if (status || ((resp[0] << 8) | resp[1]) != priv->features) {
+		dev_err(&priv->spi->dev, "Error switching on the status header\n");
+		/* Writes look the same either way, so switching it off is safe */
+		priv->status_hdr = false;
+		cmd[0] = SET_STATUS;
+		cmd[1] = 0;
+		ssed_write(priv, cmd, sizeof(cmd));
+		return;
+	}
+
+	dev_info(&priv->spi->dev, "Status header on\n");
+}
+
+/* Sends test patterns with the ECHO command at speed_hz and checks, if they come back */
+static bool ssed_echo_test(struct ssed_net *priv, u32 speed_hz)
+{
+	u8 wdata[5], rdata[4];
+	int i, j, status;
+
+	wdata[0] = ECHO;
+	for (i = 0; i < SSED_CALIB_ROUNDS; i++) {
+		for (j = 0; j < sizeof(rdata); j++)
+			wdata[j + 1] = (0x5a << j) ^ (0xa5 >> i) ^ (i << 4);
+
+		ssed_bus_lock(priv);
+		status = ssed_read_write_hz(priv, wdata, sizeof(wdata), rdata, sizeof(rdata),
+					    speed_hz);
+		ssed_bus_unlock(priv);
+
+		if (status || memcmp(&wdata[1], rdata, sizeof(rdata)))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Searches the shortest turnaround, the W7500 firmware still answers
+ * reliably at, and adds a safety margin to it. The configured turnaround
+ * is the upper bound. Firmware without ECHO support keeps it.
+ */
+static void ssed_calibrate_turnaround(struct ssed_net *priv)
+{
+	unsigned int max = priv->turnaround_us, lo = 0, hi = max;
+
+	if (!ssed_echo_test(priv, priv->ctrl_hz)) {
+		dev_info(&priv->spi->dev, "No ECHO support, keep turnaround of %u us\n", hi);
+		return;
+	}
+
+	while (lo < hi) {
+		priv->turnaround_us = (lo + hi) / 2;
+		if (ssed_echo_test(priv, priv->ctrl_hz))
+			hi = priv->turnaround_us;
+		else
+			lo = priv->turnaround_us + 1;
+	}
+
+	/* 25% + 1us margin, but never more than we started with */
+	priv->turnaround_us = min(hi + hi / 4 + 1, max);
+	dev_info(&priv->spi->dev, "Calibrated turnaround to %u us\n", priv->turnaround_us);
+}
+
+/*
+ * Doubles the data clock from the slow clock on, until the ECHOs don't come
+ * back right anymore, and keeps a safety margin to the fastest good clock.
+ * Firmware without ECHO support runs everything at the slow clock.
+ */
+static void ssed_calibrate_clock(struct ssed_net *priv)
+{
+	u32 limit = SSED_DATA_HZ_MAX, good = priv->ctrl_hz, hz;
+
+	if (priv->spi->controller->max_speed_hz)
+		limit = min(limit, priv->spi->controller->max_speed_hz);
+
+	if (!ssed_echo_test(priv, good)) {
+		dev_info(&priv->spi->dev, "No ECHO support, keep SPI clock of %u Hz\n", good);
+		priv->calibrated_hz = good;
+		WRITE_ONCE(priv->data_hz_max, good);
+		WRITE_ONCE(priv->data_hz, good);
+		return;
+	}
+
+	for (hz = good * 2; hz <= limit; hz *= 2) {
+		if (!ssed_echo_test(priv, hz))
+			break;
+		good = hz;
+	}
+
+	/* 25% margin, but never below the clock from the devicetree */
+	priv->calibrated_hz = max(good - good / 4, priv->ctrl_hz);
+	WRITE_ONCE(priv->data_hz, priv->calibrated_hz);
+	/* With CRCs the clock backoff may go up to the fastest good clock */
+	WRITE_ONCE(priv->data_hz_max, priv->crc ? good : priv->calibrated_hz);
+	dev_info(&priv->spi->dev, "Calibrated SPI data clock to %u Hz\n", priv->calibrated_hz);
+}
+
+/* Stops the queue, if the ring is full. Returns true, if so. TX queue lock held. */
+static bool ssed_tx_ring_full(struct ssed_net *priv, unsigned int head)
+{
+	if (head - READ_ONCE(priv->tx_tail) < SSED_TX_RING_SIZE)
+		return false;
+
+	netif_stop_queue(priv->net);
+	/* Start it again, if the state machine just made space */
+	smp_mb();
+	if (head - READ_ONCE(priv->tx_tail) < SSED_TX_RING_SIZE)
+		netif_start_queue(priv->net);
+	return true;
+}
+
+/*
+ * Queues an XDP frame behind the skbs. Returns false, if there is no space
+ * or the frame is too long for the W7500. TX queue lock held.
+ */
+static bool ssed_xdp_queue(struct ssed_net *priv, struct xdp_frame *xdpf)
+{
+	unsigned int head = priv->tx_head;
+
+	if (xdpf->len > priv->net->mtu + VLAN_ETH_HLEN ||
+	    head - READ_ONCE(priv->tx_tail) >= SSED_TX_RING_SIZE ||
+	    priv->xdp_tx_queued - smp_load_acquire(&priv->xdp_done_tail) >= SSED_TX_RING_SIZE)
+		return false;
+
+	priv->tx_ring[head % SSED_TX_RING_SIZE] = (struct ssed_tx_buf) { .xdpf = xdpf };
+	priv->tx_ts[head % SSED_TX_RING_SIZE] = ktime_get_ns();
+	priv->xdp_tx_queued++;
+	smp_store_release(&priv->tx_head, ++head);
+
+	/* ssed_send() expects a free slot, while the queue runs */
+	ssed_tx_ring_full(priv, head);
+	return true;
+}
+
+/* Queues a frame from XDP_TX, the poll function kicks the state machine */
+static bool ssed_xdp_tx(struct ssed_net *priv, struct xdp_frame *xdpf)
+{
+	struct netdev_queue *txq = netdev_get_tx_queue(priv->net, 0);
+	bool queued;
+
+	__netif_tx_lock(txq, smp_processor_id());
+	queued = ssed_xdp_queue(priv, xdpf);
+	__netif_tx_unlock(txq);
+
+	return queued;
+}
+
+/*
+ * Runs the XDP program on a received frame. Unless the verdict is XDP_PASS,
+ * the frame is gone afterwards. XDP_PASS may have moved its start and end.
+ */
+static u32 ssed_xdp_run(struct ssed_net *priv, struct bpf_prog *prog, struct ssed_rx_buf *buf,
+			unsigned int *headroom, unsigned int *len)
+{
+	struct xdp_frame *xdpf;
+	struct xdp_buff xdp;
+	u32 act;
+
+	xdp_init_buff(&xdp, PAGE_SIZE, &priv->xdp_rxq);
+	xdp_prepare_buff(&xdp, page_address(buf->page), SSED_RX_HEADROOM, buf->len, false);
+
+	act = bpf_prog_run_xdp(prog, &xdp);
+	switch (act) {
+	case XDP_PASS:
+		*headroom = xdp.data - xdp.data_hard_start;
+		*len = xdp.data_end - xdp.data;
+		return act;
+	case XDP_TX:
+		xdpf = xdp_convert_buff_to_frame(&xdp);
+		if (unlikely(!xdpf) || !ssed_xdp_tx(priv, xdpf))
+			goto out_exception;
+		ssed_stats_add(priv, xdp_tx, 1);
+		return act;
+	case XDP_REDIRECT:
+		if (xdp_do_redirect(priv->net, &xdp, prog))
+			goto out_exception;
+		ssed_stats_add(priv, xdp_redirect, 1);
+		return act;
+	default:
+		bpf_warn_invalid_xdp_action(priv->net, prog, act);
+		fallthrough;
+	case XDP_ABORTED:
+out_exception:
+		trace_xdp_exception(priv->net, prog, act);
+		fallthrough;
+	case XDP_DROP:
+		break;
+	}
+
+	/* The state machine allocates concurrently, so never recycle directly */
+	page_pool_put_full_page(priv->page_pool, buf->page, false);
+	ssed_stats_add(priv, xdp_drop, 1);
+	return XDP_DROP;
+}
+
+static int ssed_poll(struct napi_struct *napi, int budget)
+{
+	struct ssed_net *priv = container_of(napi, struct ssed_net, napi);
+	struct bpf_prog *prog = READ_ONCE(priv->xdp_prog);
+	unsigned int tail = priv->rx_tail;
+	unsigned int bytes = 0, dropped = 0, headroom, len;
+	struct ssed_rx_buf *buf;
+	struct sk_buff *skb;
+	int work_done = 0;
+	u32 act, xdp_acts = 0;
+
+	/* XDP frames the state machine sent meanwhile */
+	ssed_xdp_tx_clean(priv);
+
+	while (work_done < budget && tail != smp_load_acquire(&priv->rx_head)) {
+		buf = &priv->rx_ring[tail % SSED_RX_RING_SIZE];
+		headroom = SSED_RX_HEADROOM;
+		len = buf->len;
+
+		/* XDP gets the frame, before we spend an skb on it */
+		if (prog) {
+			act = ssed_xdp_run(priv, prog, buf, &headroom, &len);
+			if (act != XDP_PASS) {
+				xdp_acts |= BIT(act);
+				bytes += buf->len;
+				goto next;
+			}
+		}
+
+		/* Wrap the skb around the pool page, the page returns to the pool on free */
+		skb = napi_build_skb(page_address(buf->page), PAGE_SIZE);
+		if (skb) {
+			skb_mark_for_recycle(skb);
+			skb_reserve(skb, headroom);
+			skb_put(skb, len);
+			bytes += len;
+			skb->protocol = eth_type_trans(skb, priv->net);
+			napi_gro_receive(napi, skb);
+		} else {
+			/* The state machine allocates concurrently, so never recycle directly */
+			page_pool_put_full_page(priv->page_pool, buf->page, false);
+			dropped++;
+		}
+
+next:
+		smp_store_release(&priv->rx_tail, ++tail);
+		work_done++;
+	}
+
+	if (xdp_acts & BIT(XDP_REDIRECT))
+		xdp_do_flush();
+	if (xdp_acts & BIT(XDP_TX))
+		ssed_sm_kick(priv, false);
+
+	if (work_done) {
+		ssed_stats_add(priv, rx_packets, work_done - dropped);
+		ssed_stats_add(priv, rx_bytes, bytes);
+		if (dropped)
+			ssed_stats_add(priv, rx_dropped, dropped);
+		priv->rx_dim_packets += work_done - dropped;
+		priv->rx_dim_bytes += bytes;
+	}
+
+	if (work_done < budget) {
+		/* The stack caught up, fetch the next frames from the W7500 */
+		if (READ_ONCE(priv->rx_pending))
+			ssed_sm_kick(priv, false);
+		if (napi_complete_done(napi, work_done) && READ_ONCE(priv->rx_dim_enabled)) {
+			struct dim_sample sample = {};
+
+			dim_update_sample(priv->rx_dim_events++, priv->rx_dim_packets,
+					  priv->rx_dim_bytes, &sample);
+			net_dim(&priv->rx_dim, &sample);
+		}
+	}
+
+	return work_done;
+}
+
+/* Stands in for the IRQ, if there is no IRQ line */
+static enum hrtimer_restart ssed_irq_poll(struct hrtimer *timer)
+{
+	struct ssed_net *priv = container_of(timer, struct ssed_net, irq_poll_timer);
+
+	ssed_sm_kick(priv, true);
+	hrtimer_forward_now(timer, us_to_ktime(READ_ONCE(priv->irq_poll_us)));
+
+	return HRTIMER_RESTART;
+}
+
+static irqreturn_t ssed_irq(int irq, void *irq_data)
+{
+	struct ssed_net *priv = (struct ssed_net *) irq_data;
+
+	/* The IRQ is an edge, the state machine reads it out, once the bus is free */
+	ssed_sm_kick(priv, true);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * MDIO engine: a SMI operation is started with one command and the W7500
+ * runs it on its own. We wait for it without holding the bus, so frames
+ * keep flowing meanwhile, and fetch the result afterwards. The mdio_lock of
+ * the mii_bus keeps a second SMI operation from starting in between.
+ */
+static int ssed_smi_busy(struct ssed_net *priv)
+{
+	u8 cmd = GET_SMI_STATUS, resp;
+	int status;
+
+	ssed_bus_lock(priv);
+	status = ssed_read_write(priv, &cmd, 1, &resp, 1);
+	ssed_bus_unlock(priv);
+
+	return status ? status : resp & SSED_SMI_BUSY;
+}
+
+static int ssed_smi_wait(struct ssed_net *priv)
+{
+	int busy, status;
+
+	if (!(priv->features & SSED_FEAT_SMI_STATUS)) {
+		/* No busy flag, sleep as long as a SMI operation takes at most */
+		usleep_range(SSED_SMI_TIME_US, SSED_SMI_TIME_US + 100);
+		return 0;
+	}
+
+	status = read_poll_timeout(ssed_smi_busy, busy, busy <= 0, SSED_SMI_POLL_US,
+				   SSED_SMI_TIMEOUT_US, true, priv);
+	if (status) {
+		dev_err(&priv->spi->dev, "SMI operation timed out\n");
+		return status;
+	}
+
+	return busy;
+}
+
+/* Starts a SMI operation and waits, until the W7500 finished it */
+static int ssed_smi_run(struct ssed_net *priv, struct spi_transfer *xfers, unsigned int num_xfers)
+{
+	unsigned int i, len = 0;
+	int status = 0;
+	u64 start;
+
+	ssed_bus_lock(priv);
+	if (priv->crc) {
+		/* Each command gets its own CRC and ACK */
+		for (i = 0; i < num_xfers && !status; i++)
+			status = ssed_write_locked(priv, xfers[i].tx_buf, xfers[i].len);
+	} else {
+		/* The commands go out of the DMA safe buffer, one behind the other */
+		for (i = 0; i < num_xfers; i++) {
+			if (WARN_ON(len + xfers[i].len > SSED_CMD_MAX_LEN + SSED_CRC_LEN)) {
+				status = -EINVAL;
+				break;
+			}
+			memcpy(priv->sync_cmd + len, xfers[i].tx_buf, xfers[i].len);
+			xfers[i].tx_buf = priv->sync_cmd + len;
+			xfers[i].speed_hz = READ_ONCE(priv->ctrl_hz);
+			len += xfers[i].len;
+		}
+		if (status) {
+			ssed_bus_unlock(priv);
+			return status;
+		}
+		start = ktime_get_ns();
+		status = spi_sync_transfer(priv->spi, xfers, num_xfers);
+		/* Each transfer is a command of its own */
+		for (i = 0; i < num_xfers; i++)
+			ssed_count_spi(priv, *(const u8 *)xfers[i].tx_buf, xfers[i].len, 0, status,
+				       start);
+	}
+	ssed_bus_unlock(priv);
+	if (status)
+		return status;
+
+	return ssed_smi_wait(priv);
+}
+
+/*
+ * Registers phylib reads together on every link check, BMSR latches link down.
+ * The 1000BASE-T ones come last, so 10/100 PHYs just leave them out.
+ */
+static const u8 ssed_smi_batch_regs[SSED_SMI_REGS_MAX] = {
+	MII_BMCR, MII_BMSR, MII_ADVERTISE, MII_LPA, MII_CTRL1000, MII_STAT1000,
+};
+
+/* Number of batch registers of phy_id, phylib reads the gigabit ones only on gigabit PHYs */
+static unsigned int ssed_smi_batch_num(struct mii_bus *bus, int phy_id)
+{
+	struct phy_device *phydev = mdiobus_get_phy(bus, phy_id);
+
+	return phydev && phydev->is_gigabit_capable ? SSED_SMI_REGS_MAX : SSED_SMI_REGS_100;
+}
+
+/* Reads the batch registers of phy_id in one transaction */
+static int ssed_smi_read_batch(struct ssed_net *priv, int phy_id, unsigned int num)
+{
+	u8 data[3 + SSED_SMI_REGS_MAX], cmd = GET_SMI_REGS, resp[2 * SSED_SMI_REGS_MAX];
+	struct spi_transfer xfer = {
+		.tx_buf = data,
+		.len = 3 + num,
+	};
+	unsigned int i;
+	int status;
+
+	data[0] = SET_SMI_REGS;
+	data[1] = phy_id;
+	data[2] = num;
+	memcpy(&data[3], ssed_smi_batch_regs, num);
+
+	/* The data path has the bus, while the W7500 reads the PHY */
+	status = ssed_smi_run(priv, &xfer, 1);
+	if (status)
+		return status;
+
+	ssed_bus_lock(priv);
+	status = ssed_read_write(priv, &cmd, 1, resp, 2 * num);
+	ssed_bus_unlock(priv);
+	if (status)
+		return status;
+
+	for (i = 0; i < num; i++)
+		priv->smi_batch[i] = (resp[2 * i] << 8) | resp[2 * i + 1];
+	priv->smi_batch_addr = phy_id;
+	priv->smi_batch_num = num;
+	priv->smi_batch_valid = GENMASK(num - 1, 0);
+	priv->smi_batch_expires = jiffies + msecs_to_jiffies(SSED_SMI_BATCH_MS);
+	return 0;
+}
+
+/*
+ * Returns the value of a batch register, -ENOENT for the single register path
+ * or an error. Every value is good for one read only, so reading BMSR twice
+ * gets the latched link state from the batch and the current one on its own.
+ */
+static int ssed_smi_batch_get(struct mii_bus *bus, int phy_id, int reg)
+{
+	struct ssed_net *priv = bus->priv;
+	unsigned int i, num = ssed_smi_batch_num(bus, phy_id);
+	int status;
+
+	for (i = 0; i < num; i++)
+		if (ssed_smi_batch_regs[i] == reg)
+			break;
+	if (i == num)
+		return -ENOENT;
+
+	if (priv->smi_batch_addr != phy_id || priv->smi_batch_num != num ||
+	    time_after(jiffies, priv->smi_batch_expires)) {
+		status = ssed_smi_read_batch(priv, phy_id, num);
+		if (status)
+			return status;
+	} else if (!(priv->smi_batch_valid & BIT(i))) {
+		/* Consumed already, one register is cheaper than the whole list */
+		return -ENOENT;
+	}
+
+	priv->smi_batch_valid &= ~BIT(i);
+	return priv->smi_batch[i];
+}
+
+static int ssed_mdio_read(struct mii_bus *bus, int phy_id, int reg)
+{
+	int status, id;
+	u8 data[3], cmd = GET_SMI, resp[2];
+	struct ssed_net *priv = bus->priv;
+	struct spi_transfer xfer = {
+		.tx_buf = data,
+		.len = sizeof(data),
+	};
+//	struct device *dev = &priv->spi->dev;
+
+//	dev_info(dev, "ssed_mdio_read phy_id: %d, reg: 0x%x\n", phy_id, reg);
+
+	id = reg == MII_PHYSID1 ? 0 : reg == MII_PHYSID2 ? 1 : -1;
+	if (id >= 0 && (priv->smi_id_cached[id] & BIT(phy_id)))
+		return priv->smi_id[phy_id][id];
+
+	/* Only the busy flag tells, when the whole list is done */
+	if ((priv->features & SSED_FEAT_SMI_REGS) && (priv->features & SSED_FEAT_SMI_STATUS)) {
+		status = ssed_smi_batch_get(bus, phy_id, reg);
+		if (status != -ENOENT)
+			return status;
+	}
+
+	data[0] = SET_SMI_OP;
+	data[1] = (phy_id >> 4);
+	data[2] = reg | (phy_id << 5);
+
+	status = ssed_smi_run(priv, &xfer, 1);
+	if (status)
+		return status;
+
+	/* Fetch the result */
+	ssed_bus_lock(priv);
+	status = ssed_read_write(priv, &cmd, 1, resp, sizeof(resp));
+	ssed_bus_unlock(priv);
+	if (status)
+		return status;
+
+	status = (resp[0] << 8) | resp[1];
+//	dev_info(dev, "ssed_mdio_read returned: 0x%x\n", status);
+	if (id >= 0) {
+		priv->smi_id[phy_id][id] = status;
+		priv->smi_id_cached[id] |= BIT(phy_id);
+	}
+	return status;
+}
+
+static int ssed_mdio_write(struct mii_bus *bus, int phy_id, int reg, u16 val)
+{
+	u8 data[3], op[3];
+	struct ssed_net *priv = bus->priv;
+	struct spi_transfer xfers[] = {
+		{
+			.tx_buf = data,
+			.len = sizeof(data),
+			.cs_change = 1,
+			.cs_change_delay = SSED_CS_NO_GAP,
+		}, {
+			.tx_buf = op,
+			.len = sizeof(op),
+		},
+	};
+//	struct device *dev = &priv->spi->dev;
+
+//	dev_info(dev, "ssed_mdio_write phy_id: %d, reg: 0x%x, val: 0x%x\n", phy_id, reg, val);
+
+	data[0] = SET_SMI;
+	data[1] = (val >> 4);
+	data[2] = val;
+
+	op[0] = SET_SMI_OP;
+	op[1] = (1 << 2) | (phy_id >> 4);
+	op[2] = reg | (phy_id << 5);
+
+	/* The write may change any register, e.g. a reset */
+	if (priv->smi_batch_addr == phy_id)
+		priv->smi_batch_valid = 0;
+
+	/* Only return, once the value really is in the PHY */
+	return ssed_smi_run(priv, xfers, ARRAY_SIZE(xfers));
+}
+
+static int ssed_mdio_init(struct ssed_net *priv)
+{
+	struct mii_bus *bus;
+	int status, i;
+	struct device *dev = &priv->spi->dev;
+
+	bus = mdiobus_alloc();
+	if (!bus) {
+		dev_err(dev, "Failed to allocate mdiobus\n");
+		return -ENOMEM;
+	}
+
+	/* Unique per SPI device, so several W7500 can share a host */
+	snprintf(bus->id, MII_BUS_ID_SIZE, "ssed-%s", dev_name(dev));
+	bus->priv = priv;
+	bus->name = "SSED MDIO";
+	bus->read = ssed_mdio_read;
+	bus->write = ssed_mdio_write;
+	bus->parent = &priv->spi->dev;
+	/*
+	 * The W7500 watches the link and raises an IRQ on changes, so phylib
+	 * needs not poll the PHY over the slow SMI commands.
+	 */
+	if (priv->features & SSED_FEAT_LINK_IRQ)
+		for (i = 0; i < PHY_MAX_ADDR; i++)
+			bus->irq[i] = PHY_MAC_INTERRUPT;
+
+	status = mdiobus_register(bus);
+
+	if (status) {
+		dev_err(dev, "Failed to register mdiobus\n");
+		goto out;
+	}
+
+	priv->phy = phy_find_first(bus);
+	if (!priv->phy) {
+		dev_err(dev, "No PHY found!\n");
+		mdiobus_unregister(bus);
+		status = -1;
+		goto out;
+	}
+
+	printk("Found PHY %s\n", priv->phy->drv->name);
+
+	priv->mii_bus = bus;
+
+	return 0;
+out:
+	mdiobus_free(bus);
+	return status;
+}
+
+static void ssed_xmit_timeout(struct net_device *net, unsigned int txqueue)
+{
+	struct ssed_net *priv = netdev_priv(net);
+	unsigned long flags;
+
+	dev_warn(&priv->spi->dev, "XMIT timeout\n");
+	netif_trans_update(priv->net);
+
+	/* Maybe we missed the frame sent IRQ, ask again */
+	spin_lock_irqsave(&priv->sm_lock, flags);
+	ssed_tx_credit_reset(priv);
+	priv->tx_blocked = false;
+	spin_unlock_irqrestore(&priv->sm_lock, flags);
+	/* With status headers only a response brings the credit back, read one */
+	ssed_sm_kick(priv, true);
+}
+
+static void ssed_adjust_link(struct net_device *net)
+{
+	struct ssed_net *priv = netdev_priv(net);
+	struct phy_device *phy = net->phydev;
+
+	/* phylib manages the carrier, just tell about it */
+	if (phy->link != priv->link) {
+		priv->link = phy->link;
+		phy_print_status(phy);
+		/* Flush the frames, which won't make it out anymore */
+		if (!phy->link)
+			ssed_sm_kick(priv, false);
+	}
+}
+
+static int ssed_ioctl(struct net_device *net, struct ifreq *rq, int cmd)
+{
+	if (!net->phydev) {
+		dev_err(&net->dev, "No phydev\n");
+		return -EINVAL;
+	}
+
+	if (!netif_running(net)) {
+		dev_err(&net->dev, "Netdev not running\n");
+		return -EINVAL;
+	}
+
+	switch (cmd) {
+		case SIOCGMIIPHY:
+		case SIOCGMIIREG:
+		case SIOCSMIIREG:
+			return phy_mii_ioctl(net->phydev, rq, cmd);
+		default:
+			return -EOPNOTSUPP;
+	}
+}
+
+static int ssed_set_mac_addr(struct net_device *net, void *address)
+{
+	struct ssed_net *priv = netdev_priv(net);
+	struct sockaddr *addr = address;
+	u8 data[7];
+	int status;
+
+	if (netif_running(net))
+		return -EBUSY;
+
+	eth_hw_addr_set(net, addr->sa_data);
+	data[0] = SET_MAC;
+	memcpy(&data[1], addr->sa_data, ETH_ALEN);
+
+	status = ssed_write(priv, data, sizeof(data));
+
+	return 0;
+}
+
+/* Hands the interrupt moderation to the W7500 */
+static int ssed_write_coalesce(struct ssed_net *priv, u16 rx_usecs, u8 rx_frames, u8 tx_frames)
+{
+	u8 data[SSED_COALESCE_LEN];
+
+	data[0] = SET_COALESCE;
+	data[1] = rx_usecs >> 8;
+	data[2] = rx_usecs;
+	data[3] = rx_frames;
+	data[4] = tx_frames;
+
+	return ssed_write(priv, data, sizeof(data));
+}
+
+/*
+ * DIM picked a new profile for the traffic it saw. net_dim() schedules this
+ * on the system workqueue, the SPI write waits for the bus on our own worker.
+ */
+static void ssed_rx_dim_work(struct work_struct *work)
+{
+	struct dim *dim = container_of(work, struct dim, work);
+	struct ssed_net *priv = container_of(dim, struct ssed_net, rx_dim);
+
+	queue_work(priv->wq, &priv->coalesce_work);
+}
+
+/* Applies the profile DIM picked, it doesn't change until we are done */
+static void ssed_coalesce_work(struct work_struct *work)
+{
+	struct ssed_net *priv = container_of(work, struct ssed_net, coalesce_work);
+	struct dim *dim = &priv->rx_dim;
+	struct dim_cq_moder moder = net_dim_get_rx_moderation(dim->mode, dim->profile_ix);
+
+	ssed_write_coalesce(priv, min_t(u32, moder.usec, SSED_COALESCE_MAX_USECS),
+			    clamp_t(u32, moder.pkts, 1, SSED_COALESCE_MAX_FRAMES),
+			    READ_ONCE(priv->tx_frames));
+	dim->state = DIM_START_MEASURE;
+}
+
+static int ssed_xdp_xmit(struct net_device *net, int n, struct xdp_frame **frames, u32 flags)
+{
+	struct ssed_net *priv = netdev_priv(net);
+	struct netdev_queue *txq = netdev_get_tx_queue(net, 0);
+	int sent;
+
+	if (unlikely(flags & ~XDP_XMIT_FLAGS_MASK))
+		return -EINVAL;
+	if (unlikely(!netif_running(net) || !netif_carrier_ok(net)))
+		return -ENETDOWN;
+
+	__netif_tx_lock(txq, smp_processor_id());
+	for (sent = 0; sent < n; sent++)
+		if (!ssed_xdp_queue(priv, frames[sent]))
+			break;
+	__netif_tx_unlock(txq);
+
+	/* The caller frees the frames we didn't take */
+	ssed_stats_add(priv, xdp_xmit, sent);
+	if (sent < n)
+		ssed_stats_add(priv, tx_dropped, n - sent);
+
+	if (flags & XDP_XMIT_FLUSH)
+		ssed_sm_kick(priv, false);
+
+	return sent;
+}
+
+static int ssed_xdp_setup(struct net_device *net, struct bpf_prog *prog)
+{
+	struct ssed_net *priv = netdev_priv(net);
+	struct bpf_prog *old;
+
+	/* The poll function picks the program up with its next frame */
+	old = xchg(&priv->xdp_prog, prog);
+	if (old)
+		bpf_prog_put(old);
+
+	return 0;
+}
+
+static int ssed_bpf(struct net_device *net, struct netdev_bpf *bpf)
+{
+	switch (bpf->command) {
+	case XDP_SETUP_PROG:
+		return ssed_xdp_setup(net, bpf->prog);
+	default:
+		return -EINVAL;
+	}
+}
+
+static netdev_tx_t ssed_send(struct sk_buff *skb, struct net_device *net)
+{
+	struct ssed_net *priv = netdev_priv(net);
+	unsigned int head = priv->tx_head;
+	bool kick;
+
+	/* The link went down after the qdisc handed the frame over */
+	if (unlikely(!netif_carrier_ok(net))) {
+		dev_kfree_skb_any(skb);
+		ssed_stats_add(priv, tx_dropped, 1);
+		return NETDEV_TX_OK;
+	}
+
+	trace_ssed_tx_queue(priv->spi, skb->len, head + 1 - READ_ONCE(priv->tx_tail));
+	ssed_msg(priv, tx_queued, "add a packet to queue\n");
+	priv->tx_ring[head % SSED_TX_RING_SIZE] = (struct ssed_tx_buf) { .skb = skb };
+	priv->tx_ts[head % SSED_TX_RING_SIZE] = ktime_get_ns();
+	/* More frames follow right away, let them gather for one burst */
+	kick = __netdev_tx_sent_queue(netdev_get_tx_queue(net, 0), skb->len,
+				      netdev_xmit_more());
+	smp_store_release(&priv->tx_head, ++head);
+
+	if (ssed_tx_ring_full(priv, head))
+		kick = true;
+
+	/* If the bus is idle, the frames go out from right here */
+	if (kick)
+		ssed_sm_kick(priv, false);
+
+	return NETDEV_TX_OK;
+}
+
+static int ssed_net_open(struct net_device *net)
+{
+	struct ssed_net *priv = netdev_priv(net);
+	int status;
+
+	dev_info(&net->dev, "ssed_net_open\n");
+	status = xdp_rxq_info_reg(&priv->xdp_rxq, net, 0, priv->napi.napi_id);
+	if (status)
+		return status;
+	status = xdp_rxq_info_reg_mem_model(&priv->xdp_rxq, MEM_TYPE_PAGE_POOL, priv->page_pool);
+	if (status)
+		goto out_rxq;
+	status = phy_connect_direct(net, priv->phy, ssed_adjust_link, PHY_INTERFACE_MODE_MII);
+	if (status) {
+		dev_err(&net->dev, "Error connecting the PHY\n");
+		goto out_rxq;
+	}
+	priv->link = 0;
+	phy_start(priv->phy);
+	ssed_bus_lock(priv);
+	ssed_tx_credit_reset(priv);
+	priv->tx_blocked = false;
+	ssed_bus_unlock(priv);
+	/* The W7500 may have been reset meanwhile */
+	if (priv->features & SSED_FEAT_COALESCE)
+		ssed_write_coalesce(priv, priv->rx_usecs, priv->rx_frames, priv->tx_frames);
+	netif_start_queue(net);
+	napi_enable(&priv->napi);
+	/* Pick up frames, which arrived while we were down */
+	ssed_sm_kick(priv, true);
+	if (priv->irq_poll) {
+		priv->irq_poll_us = priv->irq_poll_min_us;
+		hrtimer_start(&priv->irq_poll_timer, us_to_ktime(priv->irq_poll_us),
+			      HRTIMER_MODE_REL_SOFT);
+	}
+	return 0;
+out_rxq:
+	xdp_rxq_info_unreg(&priv->xdp_rxq);
+	return status;
+}
+
+static int ssed_net_release(struct net_device *net)
+{
+	struct ssed_net *priv = netdev_priv(net);
+
+	dev_info(&net->dev, "ssed_net_release\n");
+	phy_stop(priv->phy);
+	phy_disconnect(priv->phy);
+	netif_stop_queue(net);
+	if (priv->irq_poll)
+		hrtimer_cancel(&priv->irq_poll_timer);
+	napi_disable(&priv->napi);
+	cancel_work_sync(&priv->rx_dim.work);
+	cancel_work_sync(&priv->coalesce_work);
+	/* Wait for the message in flight, then nothing touches the rings */
+	ssed_bus_lock(priv);
+	ssed_rx_ring_purge(priv);
+	ssed_tx_ring_purge(priv);
+	ssed_bus_unlock(priv);
+	/* The rings are empty, nothing arms it again */
+	timer_delete_sync(&priv->tx_poll_timer);
+	xdp_rxq_info_unreg(&priv->xdp_rxq);
+	return 0;
+}
+
+static ssize_t turnaround_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ssed_net *priv = netdev_priv(to_net_dev(dev));
 
-	/* Write out data */
-	status = spi_write(priv->spi, wdata, wlen);
-	if (status)
-		return status;
-	/* Small delay, so W7500 can react */
-	udelay(25);
-	/* Read back data */
-	return spi_read(priv->spi, rdata, rlen);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(priv->turnaround_us));
 }
 
-static int ssed_w8r8(struct ssed_net *priv, u8 cmd)
+static ssize_t turnaround_us_store(struct device *dev, struct device_attribute *attr,
+				   const char *buf, size_t count)
 {
+	struct ssed_net *priv = netdev_priv(to_net_dev(dev));
+	unsigned int val;
 	int status;
-	u8 resp;
-
-	mutex_lock(&priv->lock);
-	status = ssed_read_write(priv, &cmd, 1, &resp, 1);
-	mutex_unlock(&priv->lock);
 
-	if (status >= 0)
-		return resp;
-	else
+	status = kstrtouint(buf, 0, &val);
+	if (status)
 		return status;
+	if (val > SSED_TURNAROUND_MAX_US)
+		return -EINVAL;
+
+	WRITE_ONCE(priv->turnaround_us, val);
+	return count;
 }
+static DEVICE_ATTR_RW(turnaround_us);
 
-void ssed_recv_frames(struct ssed_net *priv)
+static bool ssed_hz_valid(struct ssed_net *priv, u32 hz)
 {
-	u8 data[2], cmd = RECV_FRAME;
-	u16 len;
-	struct sk_buff *skb = NULL;
+	u32 max = priv->spi->controller->max_speed_hz;
 
-	/* Allocate space for one package */
-	u8 *pkg = kmalloc(ETH_FRAME_LEN, GFP_KERNEL);
+	return hz >= SSED_HZ_MIN && (!max || hz <= max);
+}
 
-	do {
-		mutex_lock(&priv->lock);
-		/* Get length of received frame */
-		ssed_read_write(priv, &cmd, 1, data, 2);
-		len = (data[0] << 8) | data[1];
+static ssize_t spi_ctrl_hz_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ssed_net *priv = netdev_priv(to_net_dev(dev));
 
-		/* Read out package over SPI */
-		if (len)
-			spi_read(priv->spi, pkg, len);
-		mutex_unlock(&priv->lock);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(priv->ctrl_hz));
+}
 
-		/* Pass package to next layer */
-		if (len) {
-			dev_info(&priv->spi->dev, "Frame with %d bytes recv\n", len);
-			skb = dev_alloc_skb(len);
+static ssize_t spi_ctrl_hz_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct ssed_net *priv = netdev_priv(to_net_dev(dev));
+	u32 val;
+	int status;
 
-			if (!skb) {
-				dev_err(&priv->spi->dev, "Out of memory, drop RX'd frame\n");
-				continue;
-			}
+	status = kstrtou32(buf, 0, &val);
+	if (status)
+		return status;
+	if (!ssed_hz_valid(priv, val))
+		return -EINVAL;
 
-			/* Copy data */
-			skb->dev = priv->net;
-			memcpy(skb_put(skb, len), pkg, len);
-			skb->protocol = eth_type_trans(skb, priv->net);
+	WRITE_ONCE(priv->ctrl_hz, val);
+	return count;
+}
+static DEVICE_ATTR_RW(spi_ctrl_hz);
 
-			dev_info(&priv->spi->dev, "Call netif_rx...\n");
-			netif_receive_skb(skb);
-			dev_info(&priv->spi->dev, "Done\n");
-		}
-	} while (len);
+static ssize_t spi_data_hz_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ssed_net *priv = netdev_priv(to_net_dev(dev));
 
-	kfree(pkg);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(priv->data_hz));
 }
 
-void ssed_irq_work_handler(struct work_struct *work)
+/* Overrides the calibrated data clock, 0 calibrates it again */
+static ssize_t spi_data_hz_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
 {
-	u8 ir;
-	struct ssed_net *priv = container_of(work, struct ssed_net, work);
+	struct net_device *net = to_net_dev(dev);
+	struct ssed_net *priv = netdev_priv(net);
+	u32 val;
+	int status;
 
-	 /* Read out and clear IRQ */
-	ir = ssed_w8r8(priv, GET_IRQ);
+	status = kstrtou32(buf, 0, &val);
+	if (status)
+		return status;
 
-	if (ir & 0x10) {
-		dev_info(&priv->spi->dev, "Frame send\n");
-		netif_wake_queue(priv->net);
-	}
-	if (ir & 0x04) {
-		dev_info(&priv->spi->dev, "Frame reveived\n");
-		ssed_recv_frames(priv);
+	if (!val) {
+		/* A garbled ECHO at a too fast clock must not hit the data path */
+		if (netif_running(net))
+			return -EBUSY;
+		ssed_calibrate_clock(priv);
+		return count;
 	}
+	if (!ssed_hz_valid(priv, val))
+		return -EINVAL;
+
+	/* The clock backoff doesn't go beyond an override */
+	WRITE_ONCE(priv->data_hz_max, val);
+	WRITE_ONCE(priv->data_hz, val);
+	return count;
 }
+static DEVICE_ATTR_RW(spi_data_hz);
 
-static irqreturn_t ssed_irq(int irq, void *irq_data)
+static ssize_t spi_calibrated_hz_show(struct device *dev, struct device_attribute *attr,
+				      char *buf)
 {
-	struct ssed_net *priv = (struct ssed_net *) irq_data;
-	dev_info(&priv->spi->dev, "IRQ occured!\n");
+	struct ssed_net *priv = netdev_priv(to_net_dev(dev));
 
-	schedule_work(&priv->work);
+	return sysfs_emit(buf, "%u\n", priv->calibrated_hz);
+}
+static DEVICE_ATTR_RO(spi_calibrated_hz);
 
-	return 0;
+static ssize_t poll_min_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ssed_net *priv = netdev_priv(to_net_dev(dev));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(priv->irq_poll_min_us));
 }
 
-static int ssed_mdio_read(struct mii_bus *bus, int phy_id, int reg)
+static ssize_t poll_min_us_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
 {
+	struct ssed_net *priv = netdev_priv(to_net_dev(dev));
+	unsigned int val;
 	int status;
-	u8 data[3];
-	struct ssed_net *priv = bus->priv;
-//	struct device *dev = &priv->spi->dev;
-
-//	dev_info(dev, "ssed_mdio_read phy_id: %d, reg: 0x%x\n", phy_id, reg);
 
-	data[0] = SET_SMI_OP;
-	data[1] = (phy_id >> 4);
-	data[2] = reg | (phy_id << 5);
+	status = kstrtouint(buf, 0, &val);
+	if (status)
+		return status;
+	if (!val || val > READ_ONCE(priv->irq_poll_max_us))
+		return -EINVAL;
 
-	mutex_lock(&priv->lock);
+	WRITE_ONCE(priv->irq_poll_min_us, val);
+	return count;
+}
+static DEVICE_ATTR_RW(poll_min_us);
 
-	status = spi_write(priv->spi, data, sizeof(data));
-	if (status)
-		goto out;
+static ssize_t poll_max_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ssed_net *priv = netdev_priv(to_net_dev(dev));
 
-	/* Wait 1ms for the SMI transfer to finish */
-	udelay(1000);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(priv->irq_poll_max_us));
+}
 
-	data[0] = GET_SMI;
-	status = spi_write(priv->spi, data, 1);
-	if (status)
-		goto out;
+static ssize_t poll_max_us_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct ssed_net *priv = netdev_priv(to_net_dev(dev));
+	unsigned int val;
+	int status;
 
-	status = spi_read(priv->spi, data, 2);
+	status = kstrtouint(buf, 0, &val);
 	if (status)
-		goto out;
+		return status;
+	if (val < READ_ONCE(priv->irq_poll_min_us) || val > SSED_IRQ_POLL_LIMIT_US)
+		return -EINVAL;
 
-	status = (data[0] << 8) | data[1];
-//	dev_info(dev, "ssed_mdio_read returned: 0x%x\n", status);
-out:
-	mutex_unlock(&priv->lock);
-	return status;
+	WRITE_ONCE(priv->irq_poll_max_us, val);
+	return count;
 }
-
-static int ssed_mdio_write(struct mii_bus *bus, int phy_id, int reg, u16 val)
+static DEVICE_ATTR_RW(poll_max_us);
+
+/*
+ * Moves the RX processing onto cpus: the IRQ gets them as hint, so
+ * irqbalance leaves it there, and as affinity, if the irqchip can. NAPI
+ * runs in its own thread pinned to them. An empty mask lets the scheduler
+ * decide again. RTNL held.
+ */
+static int ssed_set_rx_cpus(struct ssed_net *priv, const struct cpumask *cpus)
 {
+	const struct cpumask *mask = cpumask_empty(cpus) ? NULL : cpus;
 	int status;
-	u8 data[3];
-	struct ssed_net *priv = bus->priv;
-//	struct device *dev = &priv->spi->dev;
 
-//	dev_info(dev, "ssed_mdio_write phy_id: %d, reg: 0x%x, val: 0x%x\n", phy_id, reg, val);
+	/* GPIO irqchips often can't move their IRQs, the hint is set anyway */
+	if (!priv->irq_poll && irq_set_affinity_and_hint(priv->spi->irq, mask))
+		dev_dbg(&priv->spi->dev, "IRQ affinity not set, hint only\n");
 
-	data[0] = SET_SMI;
-	data[1] = (val >> 4);
-	data[2] = val;
+	/* Threaded NAPI stays on, if it was on, only the pinning goes */
+	if (mask) {
+		status = dev_set_threaded(priv->net, true);
+		if (status)
+			return status;
+	}
+	if (priv->napi.thread)
+		return set_cpus_allowed_ptr(priv->napi.thread, mask ? mask : cpu_possible_mask);
 
-	mutex_lock(&priv->lock);
+	return 0;
+}
 
-	status = spi_write(priv->spi, data, sizeof(data));
-	if (status)
-		goto out;
+static ssize_t ssed_cpus_show(struct cpumask *cpus, char *buf)
+{
+	return sysfs_emit(buf, "%*pb\n", cpumask_pr_args(cpus));
+}
 
-	data[0] = SET_SMI_OP;
-	data[1] = (1 << 2) | (phy_id >> 4);
-	data[2] = reg | (phy_id << 5);
+static int ssed_cpus_parse(const char *buf, struct cpumask *cpus)
+{
+	int status;
 
-	status = spi_write(priv->spi, data, sizeof(data));
+	status = cpumask_parse(buf, cpus);
 	if (status)
-		goto out;
+		return status;
+	if (!cpumask_empty(cpus) && !cpumask_intersects(cpus, cpu_online_mask))
+		return -EINVAL;
 
-out:
-	mutex_unlock(&priv->lock);
-	return status;
+	return 0;
 }
 
-static int ssed_mdio_init(struct ssed_net *priv)
+static ssize_t rx_cpus_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	struct mii_bus *bus;
-	int status;
-	struct device *dev = &priv->spi->dev;
+	struct ssed_net *priv = netdev_priv(to_net_dev(dev));
 
-	bus = mdiobus_alloc();
-	if (!bus) {
-		dev_err(dev, "Failed to allocate mdiobus\n");
-		return -ENOMEM;
-	}
+	return ssed_cpus_show(&priv->rx_cpus, buf);
+}
 
-	snprintf(bus->id, MII_BUS_ID_SIZE, "mdio-ssed");
-	bus->priv = priv;
-	bus->name = "SSED MDIO";
-	bus->read = ssed_mdio_read;
-	bus->write = ssed_mdio_write;
-	bus->parent = &priv->spi->dev;
+static ssize_t rx_cpus_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct ssed_net *priv = netdev_priv(to_net_dev(dev));
+	cpumask_var_t cpus;
+	int status;
 
-	status = mdiobus_register(bus);
+	if (!alloc_cpumask_var(&cpus, GFP_KERNEL))
+		return -ENOMEM;
 
-	if (status) {
-		dev_err(dev, "Failed to register mdiobus\n");
+	status = ssed_cpus_parse(buf, cpus);
+	if (status)
 		goto out;
-	}
 
-	priv->phy = phy_find_first(bus);
-	if (!priv->phy) {
-		dev_err(dev, "No PHY found!\n");
-		mdiobus_unregister(bus);
-		status = -1;
+	if (!rtnl_trylock()) {
+		status = restart_syscall();
 		goto out;
 	}
+	status = ssed_set_rx_cpus(priv, cpus);
+	if (!status)
+		cpumask_copy(&priv->rx_cpus, cpus);
+	rtnl_unlock();
+out:
+	free_cpumask_var(cpus);
+	return status ? status : count;
+}
+static DEVICE_ATTR_RW(rx_cpus);
+
+static struct attribute *ssed_attrs[] = {
+	&dev_attr_turnaround_us.attr,
+	&dev_attr_spi_ctrl_hz.attr,
+	&dev_attr_spi_data_hz.attr,
+	&dev_attr_spi_calibrated_hz.attr,
+	&dev_attr_poll_min_us.attr,
+	&dev_attr_poll_max_us.attr,
+	&dev_attr_rx_cpus.attr,
+	NULL,
+};
 
-	printk("Found PHY %s\n", priv->phy->drv->name);
-	priv->net->phydev = priv->phy;
+/* The poll interval only exists in polling mode */
+static umode_t ssed_attr_is_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	struct ssed_net *priv = netdev_priv(to_net_dev(kobj_to_dev(kobj)));
 
-	priv->mii_bus = bus;
+	if (!priv->irq_poll && (attr == &dev_attr_poll_min_us.attr ||
+				attr == &dev_attr_poll_max_us.attr))
+		return 0;
 
-	return 0;
-out:
-	mdiobus_free(bus);
-	return status;
+	return attr->mode;
 }
 
-static void ssed_xmit_timeout(struct net_device *net, unsigned int txqueue)
+static const struct attribute_group ssed_attr_group = {
+	.attrs = ssed_attrs,
+	.is_visible = ssed_attr_is_visible,
+};
+
+static int ssed_get_coalesce(struct net_device *net, struct ethtool_coalesce *ec,
+			     struct kernel_ethtool_coalesce *kec, struct netlink_ext_ack *extack)
 {
 	struct ssed_net *priv = netdev_priv(net);
-	dev_info(&priv->spi->dev, "XMIT timeout\n");
-	netif_trans_update(priv->net);
-	netif_wake_queue(priv->net);
+
+	ec->rx_coalesce_usecs = priv->rx_usecs;
+	ec->rx_max_coalesced_frames = priv->rx_frames;
+	ec->tx_max_coalesced_frames = priv->tx_frames;
+	ec->use_adaptive_rx_coalesce = priv->rx_dim_enabled;
+
+	return 0;
 }
 
-static int ssed_ioctl(struct net_device *net, struct ifreq *rq, int cmd)
+static int ssed_set_coalesce(struct net_device *net, struct ethtool_coalesce *ec,
+			     struct kernel_ethtool_coalesce *kec, struct netlink_ext_ack *extack)
 {
-	if (!net->phydev) {
-		dev_err(&net->dev, "No phydev\n");
-		return -EINVAL;
-	}
+	struct ssed_net *priv = netdev_priv(net);
+	bool dim_enabled = ec->use_adaptive_rx_coalesce;
 
-	if (!netif_running(net)) {
-		dev_err(&net->dev, "Netdev not running\n");
+	if (!(priv->features & SSED_FEAT_COALESCE)) {
+		NL_SET_ERR_MSG(extack, "Firmware doesn't support interrupt moderation");
+		return -EOPNOTSUPP;
+	}
+	if (ec->rx_coalesce_usecs > SSED_COALESCE_MAX_USECS ||
+	    !ec->rx_max_coalesced_frames || ec->rx_max_coalesced_frames > SSED_COALESCE_MAX_FRAMES ||
+	    !ec->tx_max_coalesced_frames || ec->tx_max_coalesced_frames > SSED_COALESCE_MAX_FRAMES)
 		return -EINVAL;
+	/* Old firmware sends the next frame only after the frame sent IRQ */
+	if (ec->tx_max_coalesced_frames > 1 && !(priv->features & SSED_FEAT_TX_FREE)) {
+		NL_SET_ERR_MSG(extack, "tx-frames > 1 needs firmware reporting its TX space");
+		return -EOPNOTSUPP;
 	}
 
-	switch (cmd) {
-		case SIOCGMIIPHY:
-		case SIOCGMIIREG:
-		case SIOCSMIIREG:
-			return phy_mii_ioctl(net->phydev, rq, cmd);
-		default:
-			return -EOPNOTSUPP;
-	}
+	priv->rx_usecs = ec->rx_coalesce_usecs;
+	priv->rx_frames = ec->rx_max_coalesced_frames;
+	WRITE_ONCE(priv->tx_frames, ec->tx_max_coalesced_frames);
+
+	WRITE_ONCE(priv->rx_dim_enabled, dim_enabled);
+	if (dim_enabled)
+		return 0;
+
+	/* Back to the static setting, DIM must not overwrite it anymore */
+	cancel_work_sync(&priv->rx_dim.work);
+	cancel_work_sync(&priv->coalesce_work);
+	return ssed_write_coalesce(priv, priv->rx_usecs, priv->rx_frames, priv->tx_frames);
 }
 
-static int ssed_set_mac_addr(struct net_device *net, void *address)
-{
-	struct ssed_net *priv = netdev_priv(net);
-	struct sockaddr *addr = address;
-	u8 data[7];
-	int status;
+/* Names of the commands counted by ethtool -S, 0 is the data following them */
+static const char * const ssed_cmd_names[SSED_NR_CMDS] = {
+	[0] = "data",
+	[SET_SMI_OP] = "set_smi_op",
+	[GET_SMI] = "get_smi",
+	[SET_SMI] = "set_smi",
+	[SET_MAC] = "set_mac",
+	[SEND_FRAME] = "send_frame",
+	[RECV_FRAME] = "recv_frame",
+	[GET_IRQ] = "get_irq",
+	[ECHO] = "echo",
+	[GET_FEATURES] = "get_features",
+	[GET_SMI_STATUS] = "get_smi_status",
+	[GET_TX_FREE] = "get_tx_free",
+	[SEND_FRAMES] = "send_frames",
+	[RECV_FRAMES] = "recv_frames",
+	[SET_COALESCE] = "set_coalesce",
+	[SET_CRC] = "set_crc",
+	[RETRANSMIT] = "retransmit",
+	[SEND_RECV_FRAME] = "send_recv_frame",
+	[SET_STATUS] = "set_status",
+	[SET_SMI_REGS] = "set_smi_regs",
+	[GET_SMI_REGS] = "get_smi_regs",
+};
 
-	if (netif_running(net))
-		return -EBUSY;
+static const char ssed_spi_stat_names[][ETH_GSTRING_LEN] = {
+	"spi_bytes",
+	"spi_overhead_bytes",
+	"spi_errors",
+	"bus_wait_ns",
+	"irq_no_work",
+	"crc_errors",
+	"crc_retries",
+	"clock_changes",
+	"xdp_drop",
+	"xdp_tx",
+	"xdp_redirect",
+	"xdp_xmit",
+};
 
-	eth_hw_addr_set(net, addr->sa_data);
-	data[0] = SET_MAC;
-	memcpy(&data[1], addr->sa_data, ETH_ALEN);
+static int ssed_get_sset_count(struct net_device *net, int sset)
+{
+	int count = ARRAY_SIZE(ssed_spi_stat_names), i;
 
-	mutex_lock(&priv->lock);
-	status =  spi_write(priv->spi, data, sizeof(data));
-	mutex_unlock(&priv->lock);
+	if (sset != ETH_SS_STATS)
+		return -EOPNOTSUPP;
 
-	return 0;
+	for (i = 0; i < SSED_NR_CMDS; i++)
+		if (ssed_cmd_names[i])
+			count++;
+
+	return count;
 }
 
-void ssed_hw_xmit(struct work_struct *work)
+static void ssed_get_strings(struct net_device *net, u32 sset, u8 *data)
 {
-	u8 spi_data[3], *data, shortpkt[ETH_ZLEN];
-	int len, status;
-	struct ssed_net *priv = container_of(work, struct ssed_net, xmit_work);
-
-	data = priv->tx_skb->data;
-	len = priv->tx_skb->len;
-	if (len < ETH_ZLEN) {
-		memset(shortpkt, 0, ETH_ZLEN);
-		memcpy(shortpkt, data, len);
-		len = ETH_ZLEN;
-		data = shortpkt;
-	}
-
-	/* Transmit the package */
-	spi_data[0] = SEND_FRAME;
-	spi_data[1] = len >> 8;
-	spi_data[2] = len;
+	int i;
 
-	mutex_lock(&priv->lock);
-	status = spi_write(priv->spi, spi_data, 3);
-	if (status)
-		goto out;
+	if (sset != ETH_SS_STATS)
+		return;
 
-	status = spi_write(priv->spi, data, len);
-	if (status)
-		goto out;
-	
-out:
-	mutex_unlock(&priv->lock);
+	for (i = 0; i < SSED_NR_CMDS; i++)
+		if (ssed_cmd_names[i])
+			ethtool_sprintf(&data, "spi_%s_cmds", ssed_cmd_names[i]);
+	for (i = 0; i < ARRAY_SIZE(ssed_spi_stat_names); i++)
+		ethtool_puts(&data, ssed_spi_stat_names[i]);
+}
 
-	dev_info(&priv->spi->dev, "Packet with %d was transfered\n", len);
+/* Sums up the per CPU counters */
+static void ssed_read_stats(struct ssed_net *priv, struct ssed_pcpu_stats *sum)
+{
+	struct ssed_pcpu_stats *stats, tmp;
+	unsigned int start;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(priv->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			memcpy(&tmp, stats, offsetof(struct ssed_pcpu_stats, syncp));
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+
+		sum->rx_packets += tmp.rx_packets;
+		sum->rx_bytes += tmp.rx_bytes;
+		sum->rx_dropped += tmp.rx_dropped;
+		sum->rx_errors += tmp.rx_errors;
+		sum->tx_packets += tmp.tx_packets;
+		sum->tx_bytes += tmp.tx_bytes;
+		sum->tx_dropped += tmp.tx_dropped;
+		sum->tx_errors += tmp.tx_errors;
+		for (i = 0; i < SSED_NR_CMDS; i++)
+			sum->spi_cmds[i] += tmp.spi_cmds[i];
+		sum->spi_bytes += tmp.spi_bytes;
+		sum->spi_overhead_bytes += tmp.spi_overhead_bytes;
+		sum->spi_errors += tmp.spi_errors;
+		sum->bus_wait_ns += tmp.bus_wait_ns;
+		sum->irq_no_work += tmp.irq_no_work;
+		sum->crc_errors += tmp.crc_errors;
+		sum->crc_retries += tmp.crc_retries;
+		sum->clock_changes += tmp.clock_changes;
+		sum->xdp_drop += tmp.xdp_drop;
+		sum->xdp_tx += tmp.xdp_tx;
+		sum->xdp_redirect += tmp.xdp_redirect;
+		sum->xdp_xmit += tmp.xdp_xmit;
+	}
 }
 
-static netdev_tx_t ssed_send(struct sk_buff *skb, struct net_device *net)
+static void ssed_get_ethtool_stats(struct net_device *net, struct ethtool_stats *estats, u64 *data)
 {
 	struct ssed_net *priv = netdev_priv(net);
+	struct ssed_pcpu_stats sum;
+	int i;
+
+	ssed_read_stats(priv, &sum);
+
+	for (i = 0; i < SSED_NR_CMDS; i++)
+		if (ssed_cmd_names[i])
+			*data++ = sum.spi_cmds[i];
+	*data++ = sum.spi_bytes;
+	*data++ = sum.spi_overhead_bytes;
+	*data++ = sum.spi_errors;
+	*data++ = sum.bus_wait_ns;
+	*data++ = sum.irq_no_work;
+	*data++ = sum.crc_errors;
+	*data++ = sum.crc_retries;
+	*data++ = sum.clock_changes;
+	*data++ = sum.xdp_drop;
+	*data++ = sum.xdp_tx;
+	*data++ = sum.xdp_redirect;
+	*data++ = sum.xdp_xmit;
+}
 
-	/* Stop the queue, we can only handle a package... */
-	netif_stop_queue(net);
-
-	dev_info(&priv->spi->dev, "add a packet to queue\n");
-	priv->tx_skb = skb;
-
-	schedule_work(&priv->xmit_work);
+static u32 ssed_get_msglevel(struct net_device *net)
+{
+	struct ssed_net *priv = netdev_priv(net);
 
-	return NETDEV_TX_OK;
+	return priv->msg_enable;
 }
 
-static int ssed_net_open(struct net_device *net)
+/* Switches the per frame logging on, while at least one device wants it */
+static void ssed_set_msglevel(struct net_device *net, u32 level)
 {
-	dev_info(&net->dev, "ssed_net_open\n");
-	return 0;
+	struct ssed_net *priv = netdev_priv(net);
+	bool was_hot = priv->msg_enable & SSED_MSG_HOT, hot = level & SSED_MSG_HOT;
+
+	if (hot && !was_hot)
+		static_branch_inc(&ssed_msg_hot);
+	priv->msg_enable = level;
+	if (!hot && was_hot)
+		static_branch_dec(&ssed_msg_hot);
 }
 
-static int ssed_net_release(struct net_device *net)
+static const struct ethtool_ops ssed_ethtool_ops = {
+	.supported_coalesce_params = ETHTOOL_COALESCE_RX_USECS |
+				     ETHTOOL_COALESCE_RX_MAX_FRAMES |
+				     ETHTOOL_COALESCE_TX_MAX_FRAMES |
+				     ETHTOOL_COALESCE_USE_ADAPTIVE_RX,
+	.get_link = ethtool_op_get_link,
+	.get_link_ksettings = phy_ethtool_get_link_ksettings,
+	.set_link_ksettings = phy_ethtool_set_link_ksettings,
+	.nway_reset = phy_ethtool_nway_reset,
+	.get_msglevel = ssed_get_msglevel,
+	.set_msglevel = ssed_set_msglevel,
+	.get_coalesce = ssed_get_coalesce,
+	.set_coalesce = ssed_set_coalesce,
+	.get_sset_count = ssed_get_sset_count,
+	.get_strings = ssed_get_strings,
+	.get_ethtool_stats = ssed_get_ethtool_stats,
+};
+
+static void ssed_get_stats64(struct net_device *net, struct rtnl_link_stats64 *stats)
 {
-	dev_info(&net->dev, "ssed_net_release\n");
-	return 0;
+	struct ssed_net *priv = netdev_priv(net);
+	struct ssed_pcpu_stats sum;
+
+	ssed_read_stats(priv, &sum);
+
+	stats->rx_packets = sum.rx_packets;
+	stats->rx_bytes = sum.rx_bytes;
+	stats->rx_dropped = sum.rx_dropped;
+	stats->rx_errors = sum.rx_errors;
+	stats->tx_packets = sum.tx_packets;
+	stats->tx_bytes = sum.tx_bytes;
+	stats->tx_dropped = sum.tx_dropped;
+	stats->tx_errors = sum.tx_errors;
 }
 
 static const struct net_device_ops ssed_net_ops = {
@@ -361,6 +3317,9 @@ static const struct net_device_ops ssed_net_ops = {
 	.ndo_tx_timeout = ssed_xmit_timeout,
 	.ndo_eth_ioctl = ssed_ioctl,
 	.ndo_set_mac_address = ssed_set_mac_addr,
+	.ndo_get_stats64 = ssed_get_stats64,
+	.ndo_bpf = ssed_bpf,
+	.ndo_xdp_xmit = ssed_xdp_xmit,
 };
 
 static void ssed_net_init(struct net_device *net)
@@ -371,18 +3330,99 @@ static void ssed_net_init(struct net_device *net)
 
 	ether_setup(net);
 	net->netdev_ops = &ssed_net_ops;
-	net->watchdog_timeo = msecs_to_jiffies(10);
+	net->ethtool_ops = &ssed_ethtool_ops;
+	net->watchdog_timeo = msecs_to_jiffies(SSED_TX_TIMEOUT_MS);
+	/* Fragments go out as transfers of their own, no need to linearize */
+	net->hw_features |= NETIF_F_SG;
+	net->features |= NETIF_F_SG;
+	net->xdp_features = NETDEV_XDP_ACT_BASIC | NETDEV_XDP_ACT_REDIRECT |
+			    NETDEV_XDP_ACT_NDO_XMIT;
 
 	memset(priv, 0, sizeof(struct ssed_net));
 	priv->net = net;
 }
 
+static int ssed_hist_show(struct seq_file *s, void *unused)
+{
+	struct ssed_hist *hist = s->private;
+	unsigned long count;
+	int i;
+
+	for (i = 0; i < SSED_HIST_BUCKETS; i++) {
+		count = atomic_long_read(&hist->buckets[i]);
+		if (!count)
+			continue;
+		if (i == SSED_HIST_BUCKETS - 1)
+			seq_printf(s, "%10llu -            ns: %lu\n", 1ULL << (i - 1), count);
+		else
+			seq_printf(s, "%10llu - %10llu ns: %lu\n", i ? 1ULL << (i - 1) : 0,
+				   (1ULL << i) - 1, count);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ssed_hist);
+
+static ssize_t ssed_hist_reset_write(struct file *file, const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct ssed_net *priv = file->private_data;
+	int i, j;
+
+	for (i = 0; i < SSED_NR_HISTS; i++)
+		for (j = 0; j < SSED_HIST_BUCKETS; j++)
+			atomic_long_set(&priv->hists[i].buckets[j], 0);
+
+	return count;
+}
+
+static const struct file_operations ssed_hist_reset_fops = {
+	.open = simple_open,
+	.write = ssed_hist_reset_write,
+	.llseek = noop_llseek,
+};
+
+/* One file per histogram, writing to reset clears them all */
+static void ssed_debugfs_init(struct ssed_net *priv)
+{
+	static const char * const names[] = {
+		[SSED_HIST_IRQ] = "irq_latency",
+		[SSED_HIST_BUS_WAIT] = "bus_wait",
+		[SSED_HIST_BUS_HOLD] = "bus_hold",
+		[SSED_HIST_TX] = "tx_latency",
+	};
+	struct dentry *cmds;
+	char name[32];
+	int i;
+
+	snprintf(name, sizeof(name), "ssed-%s", dev_name(&priv->spi->dev));
+	priv->debugfs = debugfs_create_dir(name, NULL);
+
+	for (i = 0; i < ARRAY_SIZE(names); i++)
+		debugfs_create_file(names[i], 0444, priv->debugfs, &priv->hists[i],
+				    &ssed_hist_fops);
+
+	cmds = debugfs_create_dir("cmd_latency", priv->debugfs);
+	for (i = 0; i < SSED_NR_CMDS; i++)
+		if (ssed_cmd_names[i])
+			debugfs_create_file(ssed_cmd_names[i], 0444, cmds,
+					    &priv->hists[SSED_HIST_CMD + i], &ssed_hist_fops);
+
+	debugfs_create_file("reset", 0200, priv->debugfs, priv, &ssed_hist_reset_fops);
+}
+
 
 static int ssed_probe(struct spi_device *spi)
 {
 	int status;
 	struct net_device *net;
 	struct ssed_net *priv;
+	/* The SPI core does the DMA mapping, so the pool just hands out pages */
+	struct page_pool_params pp_params = {
+		.order = 0,
+		.pool_size = SSED_RX_RING_SIZE,
+		.dma_dir = DMA_FROM_DEVICE,
+	};
 
 	dev_info(&spi->dev, "Probe function\n");
 
@@ -392,18 +3432,97 @@ static int ssed_probe(struct spi_device *spi)
 		return -ENOMEM;
 
 	priv = netdev_priv(net);
-	
+
 	priv->spi = spi;
-	INIT_WORK(&priv->work, ssed_irq_work_handler);
-	INIT_WORK(&priv->xmit_work, ssed_hw_xmit);
 	mutex_init(&priv->lock);
+	spin_lock_init(&priv->sm_lock);
+	init_waitqueue_head(&priv->sm_wq);
+	timer_setup(&priv->retry_timer, ssed_retry, 0);
+	timer_setup(&priv->tx_poll_timer, ssed_tx_poll, 0);
+	ssed_set_msglevel(net, netif_msg_init(debug, SSED_MSG_DEFAULT));
+
+	/* Without moderation, the W7500 raises an IRQ for every frame */
+	priv->rx_frames = 1;
+	priv->tx_frames = 1;
+	INIT_WORK(&priv->rx_dim.work, ssed_rx_dim_work);
+	INIT_WORK(&priv->coalesce_work, ssed_coalesce_work);
+	priv->rx_dim.mode = DIM_CQ_PERIOD_MODE_START_FROM_EQE;
+
+	priv->sm_cmd = devm_kzalloc(&spi->dev, SSED_RX_BATCH_CMD_LEN + SSED_CRC_LEN, GFP_KERNEL);
+	/* Response buffers start behind the room for the status header */
+	priv->sm_resp = devm_kzalloc(&spi->dev, SSED_STATUS_LEN + 2 + SSED_CRC_LEN, GFP_KERNEL);
+	priv->tx_hdrs = devm_kzalloc(&spi->dev, SSED_TX_BATCH_HDR_LEN +
+				     SSED_TX_BATCH_MAX * SSED_TX_RECORD_HDR_LEN, GFP_KERNEL);
+	priv->tx_pad = devm_kzalloc(&spi->dev, ETH_ZLEN, GFP_KERNEL);
+	priv->rx_dir = devm_kzalloc(&spi->dev, SSED_STATUS_LEN + SSED_RX_DIR_LEN(SSED_RX_BATCH_MAX) +
+				    SSED_CRC_LEN, GFP_KERNEL);
+	priv->tx_crc = devm_kzalloc(&spi->dev, SSED_CRC_LEN + 1, GFP_KERNEL);
+	priv->retx_cmd = devm_kzalloc(&spi->dev, 1 + SSED_CRC_LEN, GFP_KERNEL);
+	priv->sync_cmd = devm_kzalloc(&spi->dev, SSED_CMD_MAX_LEN + SSED_CRC_LEN, GFP_KERNEL);
+	priv->sync_resp = devm_kzalloc(&spi->dev, SSED_STATUS_LEN + SSED_CMD_MAX_LEN + SSED_CRC_LEN,
+				       GFP_KERNEL);
+	if (!priv->sm_cmd || !priv->sm_resp || !priv->tx_hdrs || !priv->tx_pad || !priv->rx_dir ||
+	    !priv->tx_crc || !priv->retx_cmd || !priv->sync_cmd || !priv->sync_resp) {
+		status = -ENOMEM;
+		goto out;
+	}
+	priv->sm_resp += SSED_STATUS_LEN;
+	priv->rx_dir += SSED_STATUS_LEN;
+
+	priv->stats = netdev_alloc_pcpu_stats(struct ssed_pcpu_stats);
+	if (!priv->stats) {
+		status = -ENOMEM;
+		goto out;
+	}
+
+	/* Every device has its own worker, so devices don't hold each other up */
+	priv->wq = alloc_ordered_workqueue("ssed-%s", WQ_HIGHPRI | WQ_MEM_RECLAIM,
+					   dev_name(&spi->dev));
+	if (!priv->wq) {
+		status = -ENOMEM;
+		goto out_stats;
+	}
+
+	netif_napi_add_weight(net, &priv->napi, ssed_poll,
+			      clamp_val(rx_budget, 1, NAPI_POLL_WEIGHT));
 
 	spi_set_drvdata(spi, priv);
 
+	/*
+	 * The data path messages run in the message pump of the SPI controller,
+	 * a real-time pump keeps the IRQ to SPI latency down under load.
+	 */
+	spi->rt = true;
+	status = spi_setup(spi);
+	if (status)
+		dev_warn(&spi->dev, "Error setting up real-time SPI message pump\n");
+
+	pp_params.nid = dev_to_node(&spi->dev);
+	pp_params.dev = &spi->dev;
+	priv->page_pool = page_pool_create(&pp_params);
+	if (IS_ERR(priv->page_pool)) {
+		dev_err(&spi->dev, "Error creating page pool\n");
+		status = PTR_ERR(priv->page_pool);
+		goto out_wq;
+	}
+
+	/* Turnaround from the devicetree, shortened by calibration if possible */
+	priv->turnaround_us = SSED_TURNAROUND_US;
+	device_property_read_u32(&spi->dev, "brightlight,turnaround-us", &priv->turnaround_us);
+	priv->turnaround_us = min_t(unsigned int, priv->turnaround_us, SSED_TURNAROUND_MAX_US);
+	priv->ctrl_hz = spi->max_speed_hz;
+	priv->data_hz = spi->max_speed_hz;
+	/* Calibrate with CRCs, if we can, so a garbled ECHO can't slip through */
+	ssed_read_features(priv);
+	ssed_crc_init(priv);
+	ssed_status_init(priv);
+	ssed_calibrate_turnaround(priv);
+	ssed_calibrate_clock(priv);
+
 	status = ssed_mdio_init(priv);
 	if (status) {
 		dev_err(&spi->dev, "Error init mdiobus\n");
-		goto out;
+		goto out_pool;
 	}
 
 	printk("ssed - Set the MAC address\n");
@@ -412,17 +3531,56 @@ static int ssed_probe(struct spi_device *spi)
 	eth_hw_addr_random(net);
 	dev_info(&spi->dev, "MAC address is now %pM\n", net->dev_addr);
 
-	/* Request IRQ */
-	status = request_irq(spi->irq, ssed_irq, 0, "ssed", priv);
+	/* Request IRQ, without one poll the W7500 */
+	if (spi->irq > 0) {
+		status = request_irq(spi->irq, ssed_irq, 0, dev_name(&spi->dev), priv);
+		if (status) {
+			dev_err(&spi->dev, "Error requesting interrupt\n");
+			goto out_mdio;
+		}
+	} else {
+		dev_info(&spi->dev, "No interrupt, poll the W7500\n");
+		priv->irq_poll = true;
+		priv->irq_poll_min_us = SSED_IRQ_POLL_MIN_US;
+		priv->irq_poll_max_us = SSED_IRQ_POLL_MAX_US;
+		hrtimer_setup(&priv->irq_poll_timer, ssed_irq_poll, CLOCK_MONOTONIC,
+			      HRTIMER_MODE_REL_SOFT);
+	}
+
+	net->sysfs_groups[0] = &ssed_attr_group;
+
+	ssed_debugfs_init(priv);
+
+	status = register_netdev(net);
 	if (status) {
-		dev_err(&spi->dev, "Error requesting interrupt\n");
-		goto out;
+		dev_err(&spi->dev, "Error registering netdev\n");
+		goto out_debugfs;
 	}
 
 	printk("ssed - Probing done!\n");
 
-	return register_netdev(net);
+	return 0;
+out_debugfs:
+	debugfs_remove_recursive(priv->debugfs);
+	if (!priv->irq_poll)
+		free_irq(spi->irq, priv);
+out_mdio:
+	mdiobus_unregister(priv->mii_bus);
+	mdiobus_free(priv->mii_bus);
+out_pool:
+	/* The commands above may have started the state machine, park it */
+	ssed_bus_lock(priv);
+	mutex_unlock(&priv->lock);
+	timer_delete_sync(&priv->retry_timer);
+	while (priv->rx_nr_spare)
+		page_pool_put_full_page(priv->page_pool, priv->rx_spare[--priv->rx_nr_spare], false);
+	page_pool_destroy(priv->page_pool);
+out_wq:
+	destroy_workqueue(priv->wq);
+out_stats:
+	free_percpu(priv->stats);
 out:
+	ssed_set_msglevel(net, 0);
 	free_netdev(net);
 	return status;
 }
@@ -432,12 +3590,29 @@ static void ssed_remove(struct spi_device *spi)
 	struct ssed_net *priv = spi_get_drvdata(spi);
 
 	dev_info(&spi->dev, "Remove function\n");
+	if (!priv->irq_poll) {
+		irq_update_affinity_hint(spi->irq, NULL);
+		free_irq(spi->irq, priv);
+	}
+	/* Closing the netdev lets go of the PHY, then the bus can go */
+	unregister_netdev(priv->net);
 	if (priv->mii_bus) {
 		mdiobus_unregister(priv->mii_bus);
 		mdiobus_free(priv->mii_bus);
 	}
-	free_irq(spi->irq, priv);
-	unregister_netdev(priv->net);
+	debugfs_remove_recursive(priv->debugfs);
+
+	/* Park the state machine for good, nothing gets queued anymore */
+	ssed_bus_lock(priv);
+	mutex_unlock(&priv->lock);
+	timer_delete_sync(&priv->retry_timer);
+	while (priv->rx_nr_spare)
+		page_pool_put_full_page(priv->page_pool, priv->rx_spare[--priv->rx_nr_spare], false);
+
+	page_pool_destroy(priv->page_pool);
+	destroy_workqueue(priv->wq);
+	free_percpu(priv->stats);
+	ssed_set_msglevel(priv->net, 0);
 	free_netdev(priv->net);
 }
 
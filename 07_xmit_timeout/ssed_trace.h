@@ -0,0 +1,126 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ssed
+
+#if !defined(_SSED_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SSED_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/spi/spi.h>
+
+/* Every message on the wire, cmd 0 is data following a command */
+TRACE_EVENT(ssed_spi_msg,
+	TP_PROTO(const struct spi_device *spi, u8 cmd, unsigned int len, int status,
+		 u64 duration_ns),
+
+	TP_ARGS(spi, cmd, len, status, duration_ns),
+
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&spi->dev))
+		__field(u8, cmd)
+		__field(unsigned int, len)
+		__field(int, status)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->cmd = cmd;
+		__entry->len = len;
+		__entry->status = status;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("%s cmd=0x%02x len=%u status=%d duration=%lluns", __get_str(dev),
+		  __entry->cmd, __entry->len, __entry->status, __entry->duration_ns)
+);
+
+/* IRQ flags read with GET_IRQ */
+TRACE_EVENT(ssed_irq,
+	TP_PROTO(const struct spi_device *spi, u8 ir),
+
+	TP_ARGS(spi, ir),
+
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&spi->dev))
+		__field(u8, ir)
+	),
+
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->ir = ir;
+	),
+
+	TP_printk("%s ir=0x%02x", __get_str(dev), __entry->ir)
+);
+
+/* Frame read from the W7500 and queued for the poll function */
+TRACE_EVENT(ssed_rx_frame,
+	TP_PROTO(const struct spi_device *spi, unsigned int len),
+
+	TP_ARGS(spi, len),
+
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&spi->dev))
+		__field(unsigned int, len)
+	),
+
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->len = len;
+	),
+
+	TP_printk("%s len=%u", __get_str(dev), __entry->len)
+);
+
+/* Frame queued by ssed_send(), queued is the ring fill afterwards */
+TRACE_EVENT(ssed_tx_queue,
+	TP_PROTO(const struct spi_device *spi, unsigned int len, unsigned int queued),
+
+	TP_ARGS(spi, len, queued),
+
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&spi->dev))
+		__field(unsigned int, len)
+		__field(unsigned int, queued)
+	),
+
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->len = len;
+		__entry->queued = queued;
+	),
+
+	TP_printk("%s len=%u queued=%u", __get_str(dev), __entry->len, __entry->queued)
+);
+
+/* Frames written to the W7500 in one message */
+TRACE_EVENT(ssed_tx_done,
+	TP_PROTO(const struct spi_device *spi, unsigned int count, unsigned int bytes, int status),
+
+	TP_ARGS(spi, count, bytes, status),
+
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&spi->dev))
+		__field(unsigned int, count)
+		__field(unsigned int, bytes)
+		__field(int, status)
+	),
+
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->count = count;
+		__entry->bytes = bytes;
+		__entry->status = status;
+	),
+
+	TP_printk("%s count=%u bytes=%u status=%d", __get_str(dev), __entry->count,
+		  __entry->bytes, __entry->status)
+);
+
+#endif /* _SSED_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ssed_trace
+#include <trace/define_trace.h>